@@ -0,0 +1,164 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arrow/api.h>
+#include <arrow/dataset/api.h>
+#include <arrow/dataset/file_parquet.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/filesystem/path_util.h>
+
+
+// Datasets discovered once and kept across scans: the fragments, the
+// inspected schema and, once a scan has pruned against them, the parquet
+// footers the fragments hold on to. Listing and stat'ing every file is a
+// good part of the time to first batch on CephFS, so a hit costs one stat
+// per directory instead. A changed directory mtime (files added, removed or
+// renamed) rediscovers the dataset; files rewritten in place are caught by
+// comparing their mtimes too, at most once every `file_check`.
+//
+// `Mutex` is whatever the server's handlers may block on: a thallium mutex
+// in the thallium servers, std::mutex under Flight.
+template <class Mutex>
+class BasicDatasetCatalog {
+    public:
+        explicit BasicDatasetCatalog(std::chrono::seconds file_check = std::chrono::seconds(10))
+            : file_check_(file_check) {}
+
+        arrow::Result<std::shared_ptr<arrow::dataset::FileSystemDataset>> Get(const std::string& uri) {
+            // the stats and the listing run without the lock, so other scans
+            // keep hitting the catalog meanwhile; an entry is never modified
+            // once in the map besides files_checked, which only the lock guards
+            std::shared_ptr<Entry> cached;
+            bool check_files = false;
+            {
+                std::unique_lock<Mutex> lock(mutex_);
+                auto it = entries_.find(uri);
+                if (it != entries_.end()) {
+                    cached = it->second;
+                    auto now = std::chrono::steady_clock::now();
+                    if (now - cached->files_checked >= file_check_) {
+                        // one caller compares the files, the others trust the dirs
+                        cached->files_checked = now;
+                        check_files = true;
+                    }
+                }
+            }
+            if (cached != nullptr) {
+                ARROW_ASSIGN_OR_RAISE(bool stale, Stale(*cached, check_files));
+                if (!stale) {
+                    return cached->dataset;
+                }
+            }
+            // racing discoveries of the same uri are equivalent, the last one stays
+            ARROW_ASSIGN_OR_RAISE(Entry discovered, Discover(uri));
+            auto entry = std::make_shared<Entry>(std::move(discovered));
+            std::unique_lock<Mutex> lock(mutex_);
+            entries_[uri] = entry;
+            return entry->dataset;
+        }
+
+        // drops `uri` and discovers it again right away, the number of files
+        // it has now
+        arrow::Result<int64_t> Refresh(const std::string& uri) {
+            {
+                std::unique_lock<Mutex> lock(mutex_);
+                entries_.erase(uri);
+            }
+            ARROW_ASSIGN_OR_RAISE(auto dataset, Get(uri));
+            return static_cast<int64_t>(dataset->files().size());
+        }
+
+    private:
+        struct Entry {
+            std::shared_ptr<arrow::dataset::FileSystemDataset> dataset;
+            std::shared_ptr<arrow::fs::FileSystem> fs;
+            std::map<std::string, arrow::fs::TimePoint> dirs;
+            std::map<std::string, arrow::fs::TimePoint> files;
+            std::chrono::steady_clock::time_point files_checked;
+        };
+
+        // like the selector based factory: any component below `base_dir`
+        // starting with '.' or '_' hides the path, e.g. _temporary/part-0.parquet
+        static bool Hidden(const std::string& base_dir, const std::string& path) {
+            std::string relative = path;
+            if (relative.compare(0, base_dir.size(), base_dir) == 0) {
+                relative = relative.substr(base_dir.size());
+            }
+            for (const std::string& name : arrow::fs::internal::SplitAbstractPath(relative)) {
+                if (!name.empty() && (name[0] == '.' || name[0] == '_')) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // one listing gives both the files for the factory and the mtimes
+        arrow::Result<Entry> Discover(const std::string& uri) {
+            Entry entry;
+            std::string base_dir;
+            ARROW_ASSIGN_OR_RAISE(entry.fs, arrow::fs::FileSystemFromUri(uri, &base_dir));
+            ARROW_ASSIGN_OR_RAISE(arrow::fs::FileInfo base, entry.fs->GetFileInfo(base_dir));
+            entry.dirs[base_dir] = base.mtime();
+
+            arrow::fs::FileSelector s;
+            s.base_dir = base_dir;
+            s.recursive = true;
+            ARROW_ASSIGN_OR_RAISE(std::vector<arrow::fs::FileInfo> infos, entry.fs->GetFileInfo(s));
+            std::vector<arrow::fs::FileInfo> files;
+            for (auto &info : infos) {
+                if (Hidden(base_dir, info.path())) {
+                    // writers churn in their staging directories, no need to rediscover
+                    continue;
+                }
+                if (info.IsDirectory()) {
+                    entry.dirs[info.path()] = info.mtime();
+                } else if (info.IsFile()) {
+                    entry.files[info.path()] = info.mtime();
+                    files.push_back(info);
+                }
+            }
+
+            auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
+            arrow::dataset::FileSystemFactoryOptions options;
+            ARROW_ASSIGN_OR_RAISE(auto factory,
+                arrow::dataset::FileSystemDatasetFactory::Make(entry.fs, files, std::move(format), options));
+            arrow::dataset::FinishOptions finish_options;
+            ARROW_ASSIGN_OR_RAISE(auto dataset, factory->Finish(finish_options));
+            entry.dataset = std::static_pointer_cast<arrow::dataset::FileSystemDataset>(dataset);
+            entry.files_checked = std::chrono::steady_clock::now();
+            return entry;
+        }
+
+        static arrow::Result<bool> Changed(const std::shared_ptr<arrow::fs::FileSystem>& fs,
+                                           const std::map<std::string, arrow::fs::TimePoint>& mtimes) {
+            std::vector<std::string> paths;
+            for (auto &path : mtimes) {
+                paths.push_back(path.first);
+            }
+            ARROW_ASSIGN_OR_RAISE(std::vector<arrow::fs::FileInfo> infos, fs->GetFileInfo(paths));
+            for (auto &info : infos) {
+                if (info.type() == arrow::fs::FileType::NotFound || info.mtime() != mtimes.at(info.path())) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static arrow::Result<bool> Stale(const Entry& entry, bool check_files) {
+            ARROW_ASSIGN_OR_RAISE(bool dirs_changed, Changed(entry.fs, entry.dirs));
+            if (dirs_changed || !check_files) {
+                return dirs_changed;
+            }
+            return Changed(entry.fs, entry.files);
+        }
+
+        std::chrono::seconds file_check_;
+        Mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<Entry>> entries_;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <arrow/api.h>
+#include <arrow/compute/expression.h>
+#include <arrow/dataset/api.h>
+#include <arrow/dataset/file_parquet.h>
+#include <arrow/io/interfaces.h>
+#include <arrow/util/parallel.h>
+#include <parquet/metadata.h>
+
+
+// Row group pruning shared by the thallium and Flight servers. `Stats` is
+// whatever the server reports the skipped row groups and bytes in (it needs
+// row_groups, row_groups_skipped, bytes and bytes_skipped), null to not count.
+
+// The row groups of `fragment` whose footer statistics don't rule out
+// `filter` (bound to the dataset schema), as a fragment of their own; null
+// when none is left. The dataset reader decodes whole row groups, so this is
+// as fine as the skipping gets.
+template <class Stats>
+arrow::Result<std::shared_ptr<arrow::dataset::FileFragment>> PruneRowGroups(
+        arrow::dataset::ParquetFileFragment& fragment,
+        const arrow::compute::Expression& filter, Stats *stats) {
+    ARROW_RETURN_NOT_OK(fragment.EnsureCompleteMetadata());
+    std::shared_ptr<parquet::FileMetaData> metadata = fragment.metadata();
+    ARROW_ASSIGN_OR_RAISE(arrow::dataset::FragmentVector pieces, fragment.SplitByRowGroup(filter));
+
+    std::vector<int> row_groups;
+    int64_t kept_bytes = 0;
+    for (auto &piece : pieces) {
+        for (int i : static_cast<arrow::dataset::ParquetFileFragment&>(*piece).row_groups()) {
+            row_groups.push_back(i);
+            kept_bytes += metadata->RowGroup(i)->total_byte_size();
+        }
+    }
+    if (stats != nullptr) {
+        int64_t bytes = 0;
+        for (int i = 0; i < metadata->num_row_groups(); i++) {
+            bytes += metadata->RowGroup(i)->total_byte_size();
+        }
+        stats->row_groups += metadata->num_row_groups();
+        stats->row_groups_skipped += metadata->num_row_groups() - static_cast<int64_t>(row_groups.size());
+        stats->bytes += bytes;
+        stats->bytes_skipped += bytes - kept_bytes;
+    }
+    if (row_groups.empty()) {
+        return std::shared_ptr<arrow::dataset::FileFragment>();
+    }
+
+    // the subset shares the footer already read, an empty list would have
+    // meant every row group
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::dataset::Fragment> pruned, fragment.Subset(row_groups));
+    return std::static_pointer_cast<arrow::dataset::FileFragment>(pruned);
+}
+
+// the same dataset without the row groups that can't match `filter`
+template <class Stats>
+arrow::Result<std::shared_ptr<arrow::dataset::Dataset>> PruneDataset(
+        const std::shared_ptr<arrow::dataset::FileSystemDataset>& dataset,
+        const arrow::compute::Expression& filter, Stats *stats) {
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::Expression bound, filter.Bind(*dataset->schema()));
+    ARROW_ASSIGN_OR_RAISE(arrow::dataset::FragmentIterator fragment_it, dataset->GetFragments());
+    ARROW_ASSIGN_OR_RAISE(arrow::dataset::FragmentVector fragments, fragment_it.ToVector());
+
+    // footers nobody has read yet are fetched all at once on the IO pool
+    // rather than one file after the other
+    ARROW_RETURN_NOT_OK(arrow::internal::ParallelFor(static_cast<int>(fragments.size()), [&](int i) {
+        return static_cast<arrow::dataset::ParquetFileFragment&>(*fragments[i]).EnsureCompleteMetadata();
+    }, arrow::io::default_io_context().executor()));
+
+    std::vector<std::shared_ptr<arrow::dataset::FileFragment>> kept;
+    for (auto &fragment : fragments) {
+        ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::dataset::FileFragment> pruned,
+                              PruneRowGroups(static_cast<arrow::dataset::ParquetFileFragment&>(*fragment), bound, stats));
+        if (pruned != nullptr) {
+            kept.push_back(std::move(pruned));
+        }
+    }
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::dataset::FileSystemDataset> pruned,
+                          arrow::dataset::FileSystemDataset::Make(dataset->schema(), dataset->partition_expression(),
+                                                                  dataset->format(), dataset->filesystem(), std::move(kept)));
+    return pruned;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <mutex>
+
+#include "dataset_catalog.h"
+
+
+using DatasetCatalog = BasicDatasetCatalog<std::mutex>;
@@ -7,6 +7,8 @@
 #include <arrow/ipc/api.h>
 #include <arrow/io/api.h>
 
+#include "prune_stats.h"
+
 class MeasureExecutionTime{
   private:
     const std::chrono::steady_clock::time_point begin;
@@ -38,9 +40,24 @@ arrow::Result<std::unique_ptr<arrow::flight::FlightClient>> ConnectToFlightServe
   return client;
 }
 
+// reads `stream` to the end, the server's pruning stats ride on the first batch
+arrow::Status ReadStream(arrow::flight::FlightStreamReader& stream, int64_t *rows, PruneStats *stats) {
+  while (true) {
+    ARROW_ASSIGN_OR_RAISE(arrow::flight::FlightStreamChunk chunk, stream.Next());
+    if (chunk.data == nullptr) {
+      return arrow::Status::OK();
+    }
+    if (chunk.app_metadata != nullptr) {
+      *stats += PruneStats::Deserialize(chunk.app_metadata->ToString());
+    }
+    *rows += chunk.data->num_rows();
+  }
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 3) {
-    std::cout << "./fc [port] [backend]" << std::endl;
+    std::cout << "./fc [port] [backend] [refresh]" << std::endl;
+    std::cout << "  refresh (1) makes the server list the dataset again before the first read" << std::endl;
     exit(1);
   }
 
@@ -52,22 +69,38 @@ int main(int argc, char *argv[]) {
 
   auto client = ConnectToFlightServer(info).ValueOrDie();
 
+  if (argc > 3 && std::string(argv[3]) == "1") {
+    arrow::flight::Action action;
+    action.type = "refresh";
+    action.body = arrow::Buffer::FromString("file:///mnt/cephfs/dataset");
+    std::unique_ptr<arrow::flight::ResultStream> results;
+    client->DoAction(action, &results);
+    std::unique_ptr<arrow::flight::Result> result;
+    results->Next(&result);
+    std::cout << "Refreshed " << result->body->ToString() << " files" << std::endl;
+  }
+
   if (backend == "dataset") {
     std::string filepath = "/mnt/cephfs/dataset";
     auto descriptor = arrow::flight::FlightDescriptor::Path({filepath});
     std::unique_ptr<arrow::flight::FlightInfo> flight_info;
     client->GetFlightInfo(descriptor, &flight_info);
-    std::shared_ptr<arrow::Table> table;
     std::unique_ptr<arrow::flight::FlightStreamReader> stream;
     client->DoGet(flight_info->endpoints()[0].ticket, &stream);
+    int64_t total_rows = 0;
+    PruneStats stats;
     {
       MEASURE_FUNCTION_EXECUTION_TIME
-      stream->ReadAll(&table);
+      ReadStream(*stream, &total_rows, &stats);
     }
-    std::cout << "Read " << table->num_rows() << " rows and " << table->num_columns() << " columns" << std::endl;
+    auto schema = stream->GetSchema().ValueOrDie();
+    std::cout << "Read " << total_rows << " rows and " << schema->num_fields() << " columns" << std::endl;
+    std::cout << "Skipped " << stats.row_groups_skipped << "/" << stats.row_groups << " row groups, "
+              << stats.bytes_skipped << "/" << stats.bytes << " bytes" << std::endl;
 
   } else {  
     int64_t total_rows = 0;
+    PruneStats stats;
     {
       MEASURE_FUNCTION_EXECUTION_TIME
       for (int i = 1; i <= 200; i++) {
@@ -77,13 +110,13 @@ int main(int argc, char *argv[]) {
         std::unique_ptr<arrow::flight::FlightInfo> flight_info;
         client->GetFlightInfo(descriptor, &flight_info);
 
-        std::shared_ptr<arrow::Table> table;
         std::unique_ptr<arrow::flight::FlightStreamReader> stream;
         client->DoGet(flight_info->endpoints()[0].ticket, &stream);
-        stream->ReadAll(&table);
-        total_rows += table->num_rows();
+        ReadStream(*stream, &total_rows, &stats);
       }
     }
     std::cout << "Read " << total_rows << " rows" << std::endl;
+    std::cout << "Skipped " << stats.row_groups_skipped << "/" << stats.row_groups << " row groups, "
+              << stats.bytes_skipped << "/" << stats.bytes << " bytes" << std::endl;
   }
 }
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+
+
+// What the row group statistics of the scanned files let the server skip
+// before reading anything. Travels as the app_metadata of the first batch
+// of a DoGet stream.
+struct PruneStats {
+    int64_t row_groups = 0;
+    int64_t row_groups_skipped = 0;
+    int64_t bytes = 0;
+    int64_t bytes_skipped = 0;
+
+    std::string Serialize() const {
+        std::stringstream ss;
+        ss << row_groups << " " << row_groups_skipped << " " << bytes << " " << bytes_skipped;
+        return ss.str();
+    }
+
+    static PruneStats Deserialize(const std::string& data) {
+        PruneStats stats;
+        std::stringstream ss(data);
+        ss >> stats.row_groups >> stats.row_groups_skipped >> stats.bytes >> stats.bytes_skipped;
+        return stats;
+    }
+
+    PruneStats& operator+=(const PruneStats& other) {
+        row_groups += other.row_groups;
+        row_groups_skipped += other.row_groups_skipped;
+        bytes += other.bytes;
+        bytes_skipped += other.bytes_skipped;
+        return *this;
+    }
+};
@@ -11,6 +11,49 @@
 #include "parquet/arrow/schema.h"
 #include "parquet/arrow/writer.h"
 #include "parquet/file_reader.h"
+#include "parquet/metadata.h"
+
+#include "prune_stats.h"
+#include "catalog.h"
+#include "prune.h"
+
+
+// A RecordBatchStream that hands the pruning stats of its scan to the client
+// as the app_metadata of the first batch, or of an empty one when every row
+// group was skipped
+class PrunedRecordBatchStream : public arrow::flight::FlightDataStream {
+    public:
+        PrunedRecordBatchStream(std::shared_ptr<arrow::RecordBatchReader> reader, PruneStats stats)
+            : stream_(std::move(reader)), stats_(stats) {}
+
+        std::shared_ptr<arrow::Schema> schema() override { return stream_.schema(); }
+
+        arrow::Result<arrow::flight::FlightPayload> GetSchemaPayload() override {
+            return stream_.GetSchemaPayload();
+        }
+
+        arrow::Result<arrow::flight::FlightPayload> Next() override {
+            ARROW_ASSIGN_OR_RAISE(arrow::flight::FlightPayload payload, stream_.Next());
+            if (sent_) {
+                return payload;
+            }
+            if (payload.ipc_message.metadata == nullptr) {
+                ARROW_ASSIGN_OR_RAISE(auto empty, arrow::RecordBatch::MakeEmpty(schema()));
+                ARROW_RETURN_NOT_OK(arrow::ipc::GetRecordBatchPayload(
+                    *empty, arrow::ipc::IpcWriteOptions::Defaults(), &payload.ipc_message));
+            }
+            payload.app_metadata = arrow::Buffer::FromString(stats_.Serialize());
+            sent_ = true;
+            return payload;
+        }
+
+        arrow::Status Close() override { return stream_.Close(); }
+
+    private:
+        arrow::flight::RecordBatchStream stream_;
+        PruneStats stats_;
+        bool sent_ = false;
+};
 
 class ParquetStorageService : public arrow::flight::FlightServerBase {
     public:
@@ -46,14 +89,6 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
 
         arrow::Status Benchmark(const arrow::flight::Ticket& request,
                                          std::unique_ptr<arrow::flight::FlightDataStream>* stream) {
-            std::string path;
-            ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(request.ticket, &path)); 
-            auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
-                
-            arrow::fs::FileSelector s;
-            s.base_dir = std::move(path);
-            s.recursive = true;
-
             auto schema = arrow::schema({
                 arrow::field("VendorID", arrow::int64()),
                 arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
@@ -74,11 +109,9 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
                 arrow::field("total_amount", arrow::float64())
             });
 
-            arrow::dataset::FileSystemFactoryOptions options;
-            ARROW_ASSIGN_OR_RAISE(auto factory, 
-                arrow::dataset::FileSystemDatasetFactory::Make(std::move(fs), s, std::move(format), options));
-            arrow::dataset::FinishOptions finish_options;
-            ARROW_ASSIGN_OR_RAISE(auto dataset,factory->Finish(finish_options));
+            ARROW_ASSIGN_OR_RAISE(auto discovered, catalog_.Get(request.ticket));
+            PruneStats stats;
+            ARROW_ASSIGN_OR_RAISE(auto dataset, PruneDataset(discovered, GetFilter(), &stats));
 
             ARROW_ASSIGN_OR_RAISE(auto scanner_builder, dataset->NewScan());
             ARROW_RETURN_NOT_OK(scanner_builder->Filter(GetFilter()));
@@ -90,7 +123,7 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
                 std::cout << "Using dataset backend: " << request.ticket << std::endl;
                 ARROW_ASSIGN_OR_RAISE(auto reader, scanner->ToRecordBatchReader());
                 *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
-                    new arrow::flight::RecordBatchStream(reader));
+                    new PrunedRecordBatchStream(reader, stats));
             } else if (backend_ == "dataset+mem") {
                 std::cout << "Using dataset+mem backend: " << request.ticket << std::endl;
                 ARROW_ASSIGN_OR_RAISE(auto table, scanner->ToTable());
@@ -99,7 +132,7 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
                 ARROW_ASSIGN_OR_RAISE(auto im_ds_scanner, im_ds_scanner_builder->Finish());
                 ARROW_ASSIGN_OR_RAISE(auto reader, im_ds_scanner->ToRecordBatchReader());
                 *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
-                    new arrow::flight::RecordBatchStream(reader));
+                    new PrunedRecordBatchStream(reader, stats));
             }
 
             return arrow::Status::OK();
@@ -142,8 +175,17 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
             }
 
             ARROW_ASSIGN_OR_RAISE(
-                auto fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true)));
-            
+                auto file_fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true), nullptr, {}));
+            PruneStats stats;
+            ARROW_ASSIGN_OR_RAISE(auto bound, GetFilter().Bind(*schema));
+            ARROW_ASSIGN_OR_RAISE(auto fragment, PruneRowGroups(*file_fragment, bound, &stats));
+            if (fragment == nullptr) {
+                ARROW_ASSIGN_OR_RAISE(auto empty, arrow::RecordBatchReader::Make(arrow::RecordBatchVector(), schema));
+                *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
+                    new PrunedRecordBatchStream(empty, stats));
+                return arrow::Status::OK();
+            }
+
             auto options = std::make_shared<arrow::dataset::ScanOptions>();
             auto scanner_builder = std::make_shared<arrow::dataset::ScannerBuilder>(
                 schema, std::move(fragment), std::move(options));
@@ -155,11 +197,27 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
             ARROW_ASSIGN_OR_RAISE(auto reader, scanner->ToRecordBatchReader());
 
             *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
-                new arrow::flight::RecordBatchStream(reader));
+                new PrunedRecordBatchStream(reader, stats));
         
             return arrow::Status::OK();
         }
 
+        // "refresh" with a dataset uri as body makes the catalog list it
+        // again, the result is the number of files it has now
+        arrow::Status DoAction(const arrow::flight::ServerCallContext&,
+                               const arrow::flight::Action& action,
+                               std::unique_ptr<arrow::flight::ResultStream>* result) {
+            if (action.type != "refresh") {
+                return arrow::Status::NotImplemented("Unknown action ", action.type);
+            }
+            ARROW_ASSIGN_OR_RAISE(int64_t files, catalog_.Refresh(action.body->ToString()));
+            std::vector<arrow::flight::Result> results(1);
+            results[0].body = arrow::Buffer::FromString(std::to_string(files));
+            *result = std::unique_ptr<arrow::flight::ResultStream>(
+                new arrow::flight::SimpleResultStream(std::move(results)));
+            return arrow::Status::OK();
+        }
+
         arrow::Status DoGet(const arrow::flight::ServerCallContext&,
                             const arrow::flight::Ticket& request,
                             std::unique_ptr<arrow::flight::FlightDataStream>* stream) {
@@ -197,6 +255,7 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
         int32_t port_;
         std::string selectivity_;
         std::string backend_;
+        DatasetCatalog catalog_;
 };
 
 int main(int argc, char *argv[]) {
@@ -1,3 +1,4 @@
+import sys
 from datetime import date
 
 import ibis
@@ -50,3 +51,7 @@ if __name__ == "__main__":
     plan = compiler.compile(query)
     print(plan)
     print(plan.SerializeToString())
+    # the plan file tc7 sends with scan_plan
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], "wb") as f:
+            f.write(plan.SerializeToString())
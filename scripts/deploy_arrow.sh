@@ -30,6 +30,8 @@ cmake -DARROW_PARQUET=ON \
   -DARROW_WITH_LZ4=ON \
   -DARROW_WITH_ZSTD=ON \
   -DARROW_FLIGHT=ON \
+  -DARROW_ACERO=ON \
+  -DARROW_SUBSTRAIT=ON \
   ..
 
 make -j$(nproc) install
@@ -0,0 +1,31 @@
+#!/bin/bash
+set -e
+
+# runs ts7/tc7 once per progress configuration, the same one on both ends,
+# and prints the scan times of each so the lowest latency one can be picked
+selectivity=${1:-100}
+scans=${2:-5}
+
+export PROJECT_ROOT=$HOME/thallium-flight-benchmark
+
+configs=(
+    "progress=0,spin=0,handlers=0"
+    "progress=1,spin=0,handlers=0"
+    "progress=1,spin=1,handlers=0"
+    "progress=1,spin=0,handlers=4"
+    "progress=1,spin=1,handlers=4"
+)
+
+for config in "${configs[@]}"; do
+    ssh node1 "rm -f /tmp/thallium_uri"
+    ssh node1 "nohup $PROJECT_ROOT/bin/ts7 $selectivity dataset+mem 4 4 4 32768 none packed 60 $config > /tmp/ts7.log 2>&1 &"
+    while ! ssh node1 "test -s /tmp/thallium_uri"; do
+        sleep 1
+    done
+
+    uri=$(ssh node1 "cat /tmp/thallium_uri")
+    $PROJECT_ROOT/bin/tc7 $uri 4 2 $scans $config
+
+    ssh node1 "pkill ts7" || true
+    sleep 2
+done
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <memory>
 #include <utility>
@@ -6,6 +8,7 @@
 #include <arrow/api.h>
 #include <arrow/csv/api.h>
 #include <arrow/dataset/api.h>
+#include <arrow/dataset/file_parquet.h>
 #include <arrow/io/api.h>
 #include <arrow/ipc/api.h>
 #include <arrow/compute/api.h>
@@ -20,6 +23,8 @@
 #include <arrow/util/vector.h>
 
 #include "payload.h"
+#include "catalog.h"
+#include "prune.h"
 
 
 namespace cp = arrow::compute;
@@ -129,31 +134,66 @@ arrow::compute::Expression GetFilter(std::string selectivity) {
   }
 }
 
-arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanDataset(cp::ExecContext& exec_context, const ScanReqRPCStub& stub, std::string backend, std::string selectivity) {
-    std::string uri = "file:///mnt/cephfs/dataset";
-
-    auto schema = arrow::schema({
-      arrow::field("VendorID", arrow::int64()),
-      arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
-      arrow::field("tpep_dropoff_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
-      arrow::field("passenger_count", arrow::int64()),
-      arrow::field("trip_distance", arrow::float64()),
-      arrow::field("RatecodeID", arrow::int64()),
-      arrow::field("store_and_fwd_flag", arrow::utf8()),
-      arrow::field("PULocationID", arrow::int64()),
-      arrow::field("DOLocationID", arrow::int64()),
-      arrow::field("payment_type", arrow::int64()),
-      arrow::field("fare_amount", arrow::float64()),
-      arrow::field("extra", arrow::float64()),
-      arrow::field("mta_tax", arrow::float64()),
-      arrow::field("tip_amount", arrow::float64()),
-      arrow::field("tolls_amount", arrow::float64()),
-      arrow::field("improvement_surcharge", arrow::float64()),
-      arrow::field("total_amount", arrow::float64())
-    });
-    
+// the filter and schemas a client serialized into its scan request
+struct ScanSpec {
+    cp::Expression filter;
+    std::shared_ptr<arrow::Schema> dataset_schema;
+    std::shared_ptr<arrow::Schema> projection_schema;
+};
+
+arrow::Result<std::shared_ptr<arrow::Schema>> ReadSchemaBuffer(uint8_t *data, size_t size) {
+    arrow::io::BufferReader reader(arrow::Buffer::Wrap(data, size));
+    arrow::ipc::DictionaryMemo memo;
+    return arrow::ipc::ReadSchema(&reader, &memo);
+}
+
+// The server's selectivity filter is ANDed in so the selectivity runs of the
+// benchmarks keep working with clients that always ask for everything
+arrow::Result<ScanSpec> DecodeScanSpec(const ScanReqRPCStub& stub, std::string selectivity) {
+    ScanSpec spec;
+    ARROW_ASSIGN_OR_RAISE(spec.filter, cp::Deserialize(arrow::Buffer::Wrap(stub.filter_buffer, stub.filter_buffer_size)));
+    spec.filter = cp::and_(spec.filter, GetFilter(selectivity));
+    ARROW_ASSIGN_OR_RAISE(spec.dataset_schema, ReadSchemaBuffer(stub.dataset_schema_buffer, stub.dataset_schema_buffer_size));
+    ARROW_ASSIGN_OR_RAISE(spec.projection_schema, ReadSchemaBuffer(stub.projection_schema_buffer, stub.projection_schema_buffer_size));
+    return spec;
+}
+
+arrow::Status ApplyTuning(arrow::dataset::ScannerBuilder& builder, const ScanTuning& tuning) {
+    ARROW_RETURN_NOT_OK(builder.UseThreads(tuning.use_threads));
+    if (tuning.batch_size > 0) {
+        ARROW_RETURN_NOT_OK(builder.BatchSize(tuning.batch_size));
+    }
+    if (tuning.batch_readahead > 0) {
+        ARROW_RETURN_NOT_OK(builder.BatchReadahead(tuning.batch_readahead));
+    }
+    if (tuning.fragment_readahead > 0) {
+        ARROW_RETURN_NOT_OK(builder.FragmentReadahead(tuning.fragment_readahead));
+    }
+    return arrow::Status::OK();
+}
+
+// the batches of `scanner` in the order the fragments finish decoding them,
+// a slow fragment doesn't hold back the ones decoded after it
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> UnorderedReader(arrow::dataset::Scanner& scanner) {
+    ARROW_ASSIGN_OR_RAISE(arrow::dataset::EnumeratedRecordBatchIterator batches, scanner.ScanBatchesUnordered());
+    auto it = arrow::MakeMapIterator([](arrow::dataset::EnumeratedRecordBatch batch) {
+        return batch.record_batch.value;
+    }, std::move(batches));
+    return arrow::RecordBatchReader::MakeFromIterator(std::move(it), scanner.options()->projected_schema);
+}
+
+const std::string kDatasetUri = "file:///mnt/cephfs/dataset";
+
+// the dataset every scan reads, without the row groups `spec` can't match.
+// Discovered anew on every call unless a catalog keeps it.
+arrow::Result<std::shared_ptr<arrow::dataset::Dataset>> OpenDataset(const ScanSpec& spec, ScanStats *stats, DatasetCatalog *catalog = nullptr) {
+    if (catalog != nullptr) {
+        ARROW_ASSIGN_OR_RAISE(auto dataset, catalog->Get(kDatasetUri));
+        return PruneDataset(dataset, spec.filter, stats);
+    }
+
     std::string path;
-    ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(uri, &path)); 
+    ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(kDatasetUri, &path)); 
     auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
       
     arrow::fs::FileSelector s;
@@ -164,50 +204,58 @@ arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanDataset(cp::ExecCon
     ARROW_ASSIGN_OR_RAISE(auto factory, 
       arrow::dataset::FileSystemDatasetFactory::Make(std::move(fs), s, std::move(format), options));
     arrow::dataset::FinishOptions finish_options;
-    ARROW_ASSIGN_OR_RAISE(auto dataset,factory->Finish(finish_options));
+    ARROW_ASSIGN_OR_RAISE(auto discovered, factory->Finish(finish_options));
+    return PruneDataset(std::static_pointer_cast<arrow::dataset::FileSystemDataset>(discovered), spec.filter, stats);
+}
+
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanDataset(cp::ExecContext& exec_context, const ScanReqRPCStub& stub, std::string backend, std::string selectivity,
+                                                                     ScanStats *stats = nullptr, DatasetCatalog *catalog = nullptr) {
+    std::string uri = kDatasetUri;
+    // rows instead of the aggregates asked for would look like a valid answer
+    if (!stub.aggregates.empty() || !stub.group_by.empty()) {
+        return arrow::Status::Invalid("Aggregates and group_by are only run by scan_aggregate");
+    }
+    ARROW_ASSIGN_OR_RAISE(ScanSpec spec, DecodeScanSpec(stub, selectivity));
+    ARROW_ASSIGN_OR_RAISE(auto dataset, OpenDataset(spec, stats, catalog));
 
     ARROW_ASSIGN_OR_RAISE(auto scanner_builder, dataset->NewScan());
-    ARROW_RETURN_NOT_OK(scanner_builder->Filter(GetFilter(selectivity)));
-    ARROW_RETURN_NOT_OK(scanner_builder->Project(schema->field_names()));
+    // only the columns the client asked for are decoded and transferred
+    ARROW_RETURN_NOT_OK(scanner_builder->Filter(spec.filter));
+    ARROW_RETURN_NOT_OK(scanner_builder->Project(spec.projection_schema->field_names()));
+    ARROW_RETURN_NOT_OK(scanner_builder->Pool(exec_context.memory_pool()));
+    ARROW_RETURN_NOT_OK(ApplyTuning(*scanner_builder, stub.tuning));
     ARROW_ASSIGN_OR_RAISE(auto scanner, scanner_builder->Finish());
 
     std::shared_ptr<arrow::RecordBatchReader> reader; 
     if (backend == "dataset") {
       std::cout << "Using dataset backend: " << uri << std::endl;
-      ARROW_ASSIGN_OR_RAISE(reader, scanner->ToRecordBatchReader());
+      if (stub.tuning.ordered) {
+        ARROW_ASSIGN_OR_RAISE(reader, scanner->ToRecordBatchReader());
+      } else {
+        ARROW_ASSIGN_OR_RAISE(reader, UnorderedReader(*scanner));
+      }
     } else if (backend == "dataset+mem") {
       std::cout << "Using dataset+mem backend: " << uri << std::endl;
       ARROW_ASSIGN_OR_RAISE(auto table, scanner->ToTable())
       auto im_ds = std::make_shared<arrow::dataset::InMemoryDataset>(table);
       ARROW_ASSIGN_OR_RAISE(auto im_ds_scanner_builder, im_ds->NewScan());
+      ARROW_RETURN_NOT_OK(im_ds_scanner_builder->Pool(exec_context.memory_pool()));
       ARROW_ASSIGN_OR_RAISE(auto im_ds_scanner, im_ds_scanner_builder->Finish());
       ARROW_ASSIGN_OR_RAISE(reader, im_ds_scanner->ToRecordBatchReader());
+    } else {
+      return arrow::Status::Invalid("Unknown dataset backend ", backend);
     }
 
     return reader;
 }
 
-arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanFile(const ScanReqRPCStub& stub, std::string backend, std::string selectivity) {
-    auto schema = arrow::schema({
-      arrow::field("VendorID", arrow::int64()),
-      arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
-      arrow::field("tpep_dropoff_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
-      arrow::field("passenger_count", arrow::int64()),
-      arrow::field("trip_distance", arrow::float64()),
-      arrow::field("RatecodeID", arrow::int64()),
-      arrow::field("store_and_fwd_flag", arrow::utf8()),
-      arrow::field("PULocationID", arrow::int64()),
-      arrow::field("DOLocationID", arrow::int64()),
-      arrow::field("payment_type", arrow::int64()),
-      arrow::field("fare_amount", arrow::float64()),
-      arrow::field("extra", arrow::float64()),
-      arrow::field("mta_tax", arrow::float64()),
-      arrow::field("tip_amount", arrow::float64()),
-      arrow::field("tolls_amount", arrow::float64()),
-      arrow::field("improvement_surcharge", arrow::float64()),
-      arrow::field("total_amount", arrow::float64())
-    });
-    
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanFile(const ScanReqRPCStub& stub, std::string backend, std::string selectivity,
+                                                                  ScanStats *stats = nullptr) {
+    if (!stub.aggregates.empty() || !stub.group_by.empty()) {
+        return arrow::Status::Invalid("Aggregates and group_by are only run by scan_aggregate");
+    }
+    ARROW_ASSIGN_OR_RAISE(ScanSpec spec, DecodeScanSpec(stub, selectivity));
+
     auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
 
     arrow::dataset::FileSource source;
@@ -219,17 +267,24 @@ arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanFile(const ScanReqR
       std::cout << "Using file+mmap backend: " << stub.path << std::endl;
       ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::MemoryMappedFile::Open(stub.path, arrow::io::FileMode::READ));
       source = arrow::dataset::FileSource(file);
+    } else {
+      return arrow::Status::Invalid("Unknown file backend ", backend);
     }
 
     ARROW_ASSIGN_OR_RAISE(
-        auto fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true)));
-    
+        auto file_fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true), nullptr, {}));
+    ARROW_ASSIGN_OR_RAISE(cp::Expression bound, spec.filter.Bind(*spec.dataset_schema));
+    ARROW_ASSIGN_OR_RAISE(auto fragment, PruneRowGroups(*file_fragment, bound, stats));
+    if (fragment == nullptr) {
+        return arrow::RecordBatchReader::Make(arrow::RecordBatchVector(), spec.projection_schema);
+    }
+
     auto options = std::make_shared<arrow::dataset::ScanOptions>();
     auto scanner_builder = std::make_shared<arrow::dataset::ScannerBuilder>(
-        schema, std::move(fragment), std::move(options));
+        spec.dataset_schema, std::move(fragment), std::move(options));
 
-    ARROW_RETURN_NOT_OK(scanner_builder->Filter(GetFilter(selectivity)));
-    ARROW_RETURN_NOT_OK(scanner_builder->Project(schema->field_names()));
+    ARROW_RETURN_NOT_OK(scanner_builder->Filter(spec.filter));
+    ARROW_RETURN_NOT_OK(scanner_builder->Project(spec.projection_schema->field_names()));
 
     ARROW_ASSIGN_OR_RAISE(auto scanner, scanner_builder->Finish());
     ARROW_ASSIGN_OR_RAISE(auto reader, scanner->ToRecordBatchReader());
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <thallium.hpp>
+
+#include "dataset_catalog.h"
+
+
+namespace tl = thallium;
+
+
+// handlers are ULTs, waiting on the catalog yields to the other ones
+using DatasetCatalog = BasicDatasetCatalog<tl::mutex>;
@@ -67,6 +67,7 @@ arrow::Result<ScanReq> GetScanRequest(std::string path,
     ScanReq req;
     req.stub = stub;
     req.schema = projection_schema;
+    req.buffers = {filter_buff, dataset_schema_buff, projection_schema_buff};
     return req;
 }
 
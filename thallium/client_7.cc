@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+#include "payload.h"
+#include "session.h"
+#include "remote_dataset.h"
+
+// copy of 4, pairs with the pipelined ring in server_7
+
+
+namespace tl = thallium;
+namespace cp = arrow::compute;
+
+
+const int32_t kTransferSize = 19 * 1024 * 1024;
+const int32_t kNumRegions = 4;
+const size_t kMinStripeSize = 1024 * 1024;
+
+
+// "function:column[,function:column...][/key[,key...]]", e.g.
+// sum:total_amount,count:total_amount/PULocationID
+arrow::Status ParseAggregates(const std::string& spec, std::vector<AggregateSpec> *aggregates, std::vector<std::string> *group_by) {
+    size_t slash = spec.find('/');
+    std::stringstream aggs(spec.substr(0, slash));
+    std::string item;
+    while (std::getline(aggs, item, ',')) {
+        size_t colon = item.find(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == item.size()) {
+            return arrow::Status::Invalid("Aggregate is not function:column: ", item);
+        }
+        std::string function = item.substr(0, colon);
+        std::string column = item.substr(colon + 1);
+        aggregates->emplace_back(function, column, function + "_" + column);
+    }
+    if (aggregates->empty()) {
+        return arrow::Status::Invalid("No aggregate in ", spec);
+    }
+    if (slash != std::string::npos) {
+        std::stringstream keys(spec.substr(slash + 1));
+        while (std::getline(keys, item, ',')) {
+            if (item.empty()) {
+                return arrow::Status::Invalid("Empty group_by key in ", spec);
+            }
+            group_by->push_back(item);
+        }
+    }
+    return arrow::Status::OK();
+}
+
+// comma separated threads=0|1, batch=N, batch_ahead=N, fragment_ahead=N and
+// ordered=0|1, e.g. threads=1,fragment_ahead=8,ordered=0
+arrow::Result<ScanTuning> ParseScanTuning(const std::string& spec) {
+    ScanTuning tuning;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            return arrow::Status::Invalid("Scan setting without a value: ", item);
+        }
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+        if (key == "threads") {
+            tuning.use_threads = value == "1";
+        } else if (key == "batch") {
+            tuning.batch_size = std::stoll(value);
+        } else if (key == "batch_ahead") {
+            tuning.batch_readahead = std::stoi(value);
+        } else if (key == "fragment_ahead") {
+            tuning.fragment_readahead = std::stoi(value);
+        } else if (key == "ordered") {
+            tuning.ordered = value == "1";
+        } else {
+            return arrow::Status::Invalid("Unknown scan setting ", key);
+        }
+    }
+    return tuning;
+}
+
+arrow::Status Main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "./tc [uri] [stripes] [depth] [scans] [engine] [plan] [aggregate] [tuning] [scanner]" << std::endl;
+        std::cout << "  depth is the number of get_next_batch calls kept in flight" << std::endl;
+        std::cout << "  scans is the number of back to back scans run on one session" << std::endl;
+        std::cout << "  engine is progress=0|1,spin=0|1,handlers=N or a margo .json file" << std::endl;
+        std::cout << "  plan is a file holding a serialized Substrait plan to run instead of the scan, - for none" << std::endl;
+        std::cout << "  aggregate is function:column[,function:column...][/key[,key...]] computed on the server, - for none" << std::endl;
+        std::cout << "  tuning is threads=0|1,batch=N,batch_ahead=N,fragment_ahead=N,ordered=0|1 for the server's decode" << std::endl;
+        std::cout << "  scanner is 1 to read the scan through an Arrow scanner over a RemoteDataset" << std::endl;
+        exit(1);
+    }
+
+    std::string uri = argv[1];
+    int32_t num_stripes = 4;
+    if (argc > 2) {
+        num_stripes = std::stoi(argv[2]);
+    }
+    int32_t depth = 2;
+    if (argc > 3) {
+        depth = std::stoi(argv[3]);
+    }
+    int32_t num_scans = 1;
+    if (argc > 4) {
+        num_scans = std::stoi(argv[4]);
+    }
+    EngineConfig engine_config;
+    if (argc > 5) {
+        ARROW_ASSIGN_OR_RAISE(engine_config, ParseEngineConfig(argv[5]));
+    }
+    std::shared_ptr<arrow::Buffer> plan;
+    if (argc > 6 && std::string(argv[6]) != "-") {
+        ARROW_ASSIGN_OR_RAISE(auto plan_file, arrow::io::ReadableFile::Open(argv[6]));
+        ARROW_ASSIGN_OR_RAISE(int64_t plan_size, plan_file->GetSize());
+        ARROW_ASSIGN_OR_RAISE(plan, plan_file->Read(plan_size));
+    }
+    std::vector<AggregateSpec> aggregates;
+    std::vector<std::string> group_by;
+    if (argc > 7 && std::string(argv[7]) != "-") {
+        ARROW_RETURN_NOT_OK(ParseAggregates(argv[7], &aggregates, &group_by));
+    }
+    ScanTuning tuning;
+    if (argc > 8) {
+        ARROW_ASSIGN_OR_RAISE(tuning, ParseScanTuning(argv[8]));
+    }
+    bool use_scanner = argc > 9 && std::stoi(argv[9]) != 0;
+    if (use_scanner && (plan != nullptr || !aggregates.empty())) {
+        return arrow::Status::Invalid("The scanner only reads plain scans, not plans or aggregates");
+    }
+
+    auto filter = 
+        cp::greater(cp::field_ref("total_amount"), cp::literal(-200));
+
+    auto schema = arrow::schema({
+        arrow::field("VendorID", arrow::int64()),
+        arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
+        arrow::field("tpep_dropoff_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
+        arrow::field("passenger_count", arrow::int64()),
+        arrow::field("trip_distance", arrow::float64()),
+        arrow::field("RatecodeID", arrow::int64()),
+        arrow::field("store_and_fwd_flag", arrow::utf8()),
+        arrow::field("PULocationID", arrow::int64()),
+        arrow::field("DOLocationID", arrow::int64()),
+        arrow::field("payment_type", arrow::int64()),
+        arrow::field("fare_amount", arrow::float64()),
+        arrow::field("extra", arrow::float64()),
+        arrow::field("mta_tax", arrow::float64()),
+        arrow::field("tip_amount", arrow::float64()),
+        arrow::field("tolls_amount", arrow::float64()),
+        arrow::field("improvement_surcharge", arrow::float64()),
+        arrow::field("total_amount", arrow::float64())
+    });
+
+    // one region per transfer in flight plus the ones the caller is holding on to
+    // shared with the fragments of a RemoteDataset
+    auto session = std::make_shared<ThalliumSession>("ofi+verbs", std::max(kNumRegions, depth + 2), kTransferSize, num_stripes,
+                                                     kMinStripeSize, depth, engine_config);
+    tl::endpoint endpoint = session->Lookup(uri);
+    std::string path = "/mnt/cephfs/dataset";
+    for (int32_t i = 0; i < num_scans; i++) {
+        int64_t total_rows = 0;
+        int64_t total_batches = 0;
+        ScanStats stats;
+        auto start = std::chrono::high_resolution_clock::now();
+        {
+            std::shared_ptr<ThalliumRecordBatchReader> remote;
+            std::shared_ptr<arrow::RecordBatchReader> reader;
+            if (plan != nullptr) {
+                ARROW_ASSIGN_OR_RAISE(remote, ThalliumRecordBatchReader::MakeFromPlan(*session, endpoint, path, plan));
+            } else if (!aggregates.empty()) {
+                ARROW_ASSIGN_OR_RAISE(remote, ThalliumRecordBatchReader::MakeAggregate(*session, endpoint, path, filter, schema, aggregates, group_by));
+            } else if (use_scanner) {
+                // filter and projection reach the server through RemoteFragment
+                auto dataset = std::make_shared<RemoteDataset>(session, endpoint, path, schema);
+                ARROW_ASSIGN_OR_RAISE(auto scanner_builder, dataset->NewScan());
+                ARROW_RETURN_NOT_OK(scanner_builder->Filter(filter));
+                ARROW_RETURN_NOT_OK(scanner_builder->Project(schema->field_names()));
+                ARROW_RETURN_NOT_OK(scanner_builder->UseThreads(tuning.use_threads));
+                if (tuning.batch_size > 0) {
+                    ARROW_RETURN_NOT_OK(scanner_builder->BatchSize(tuning.batch_size));
+                }
+                ARROW_ASSIGN_OR_RAISE(auto scanner, scanner_builder->Finish());
+                ARROW_ASSIGN_OR_RAISE(reader, scanner->ToRecordBatchReader());
+            } else {
+                ARROW_ASSIGN_OR_RAISE(remote, ThalliumRecordBatchReader::Make(*session, endpoint, path, filter, schema, schema, tuning));
+            }
+            if (remote != nullptr) {
+                reader = remote;
+            }
+            std::shared_ptr<arrow::RecordBatch> batch;
+            while (true) {
+                ARROW_RETURN_NOT_OK(reader->ReadNext(&batch));
+                if (batch == nullptr) {
+                    break;
+                }
+                total_batches++;
+                total_rows += batch->num_rows();
+                // plan results are aggregates, small enough to look at
+                if ((plan != nullptr || !aggregates.empty()) && i == 0) {
+                    std::cout << batch->ToString() << std::endl;
+                }
+            }
+            // the fragments of a scanner keep theirs to themselves
+            if (remote != nullptr) {
+                stats = remote->stats();
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "Read " << total_rows << " rows in " << std::to_string((double)std::chrono::duration_cast<std::chrono::microseconds>(end-start).count()/1000) << " ms"
+                  << " [" << engine_config.ToString() << "]" << std::endl;
+        std::cout << "Skipped " << stats.row_groups_skipped << "/" << stats.row_groups << " row groups, "
+                  << stats.bytes_skipped << "/" << stats.bytes << " bytes" << std::endl;
+    }
+    session->Finalize();
+    return arrow::Status::OK();
+}
+
+int main(int argc, char** argv) {
+    arrow::Status st = Main(argc, argv);
+    if (!st.ok()) {
+        std::cerr << "Error: " << st.ToString() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,225 @@
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <deque>
+#include <map>
+
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+#include "payload.h"
+#include "recv_pool.h"
+
+
+namespace tl = thallium;
+namespace cp = arrow::compute;
+
+
+const int32_t kTransferSize = 19 * 1024 * 1024;
+
+
+arrow::Result<ScanReq> GetScanRequest(std::string path,
+                                      cp::Expression filter, 
+                                      std::shared_ptr<arrow::Schema> projection_schema,
+                                      std::shared_ptr<arrow::Schema> dataset_schema) {
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> filter_buff, arrow::compute::Serialize(filter));
+    ARROW_ASSIGN_OR_RAISE(auto projection_schema_buff, arrow::ipc::SerializeSchema(*projection_schema));
+    ARROW_ASSIGN_OR_RAISE(auto dataset_schema_buff, arrow::ipc::SerializeSchema(*dataset_schema));
+    ScanReqRPCStub stub(
+        path,
+        const_cast<uint8_t*>(filter_buff->data()), filter_buff->size(), 
+        const_cast<uint8_t*>(dataset_schema_buff->data()), dataset_schema_buff->size(),
+        const_cast<uint8_t*>(projection_schema_buff->data()), projection_schema_buff->size()
+    );
+    ScanReq req;
+    req.stub = stub;
+    req.schema = projection_schema;
+    req.buffers = {filter_buff, dataset_schema_buff, projection_schema_buff};
+    return req;
+}
+
+ConnCtx Init(std::string protocol, std::string host) {
+    ConnCtx ctx;
+    tl::engine engine(protocol, THALLIUM_SERVER_MODE, true);
+    tl::endpoint endpoint = engine.lookup(host);
+    ctx.engine = engine;
+    ctx.endpoint = endpoint;
+    return ctx;
+}
+
+arrow::Result<ScanCtx> Scan(ConnCtx &conn_ctx, ScanReq &scan_req) {
+    tl::remote_procedure scan = conn_ctx.engine.define("scan");
+    PlanRespStub resp = scan.on(conn_ctx.endpoint)(scan_req.stub);
+    if (!resp.error.empty()) {
+        return arrow::Status::Invalid("Server rejected the scan: ", resp.error);
+    }
+    ScanCtx scan_ctx;
+    scan_ctx.uuid = resp.uuid;
+    scan_ctx.schema = scan_req.schema;
+    return scan_ctx;
+}
+
+struct PushedTransfer {
+    int32_t region;
+    int32_t seq;
+    int32_t total_size;
+};
+
+// transfers the server pushed into our regions, in arrival order
+class PushQueue {
+    public:
+        void Push(PushedTransfer t) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            queue_.push_back(std::move(t));
+            cv_.notify_one();
+        }
+
+        PushedTransfer Pop() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            while (queue_.empty()) {
+                cv_.wait(lock);
+            }
+            PushedTransfer t = std::move(queue_.front());
+            queue_.pop_front();
+            return t;
+        }
+
+    private:
+        tl::mutex mutex_;
+        tl::condition_variable cv_;
+        std::deque<PushedTransfer> queue_;
+};
+
+arrow::Status Main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "./tc [uri] [credits]" << std::endl;
+        exit(1);
+    }
+
+    std::string uri = argv[1];
+    int32_t num_credits = 4;
+    if (argc > 2) {
+        num_credits = std::stoi(argv[2]);
+    }
+
+    auto filter = 
+        cp::greater(cp::field_ref("total_amount"), cp::literal(-200));
+
+    auto schema = arrow::schema({
+        arrow::field("VendorID", arrow::int64()),
+        arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
+        arrow::field("tpep_dropoff_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
+        arrow::field("passenger_count", arrow::int64()),
+        arrow::field("trip_distance", arrow::float64()),
+        arrow::field("RatecodeID", arrow::int64()),
+        arrow::field("store_and_fwd_flag", arrow::utf8()),
+        arrow::field("PULocationID", arrow::int64()),
+        arrow::field("DOLocationID", arrow::int64()),
+        arrow::field("payment_type", arrow::int64()),
+        arrow::field("fare_amount", arrow::float64()),
+        arrow::field("extra", arrow::float64()),
+        arrow::field("mta_tax", arrow::float64()),
+        arrow::field("tip_amount", arrow::float64()),
+        arrow::field("tolls_amount", arrow::float64()),
+        arrow::field("improvement_surcharge", arrow::float64()),
+        arrow::field("total_amount", arrow::float64())
+    });
+
+    ConnCtx conn_ctx = Init("ofi+verbs", uri);
+    int64_t total_rows = 0;
+    int64_t total_batches = 0;
+
+    std::string path = "/mnt/cephfs/dataset";
+    ARROW_ASSIGN_OR_RAISE(auto scan_req, GetScanRequest(path, filter, schema, schema));
+    ARROW_ASSIGN_OR_RAISE(ScanCtx scan_ctx, Scan(conn_ctx, scan_req));
+
+    tl::remote_procedure stream = conn_ctx.engine.define("stream");
+    tl::remote_procedure return_credit = conn_ctx.engine.define("return_credit").disable_response();
+
+    // one exposed region per credit, granted to the server once for the whole scan;
+    // a credit goes back as soon as the last batch leasing its region is dropped
+    std::shared_ptr<ReceivePool> pool = std::make_shared<ReceivePool>(
+        conn_ctx.engine, num_credits, kTransferSize,
+        [&conn_ctx, &scan_ctx, &return_credit](int32_t region) {
+            return_credit.on(conn_ctx.endpoint)(scan_ctx.uuid, region);
+        });
+
+    PushQueue queue;
+    std::function<void(const tl::request&, int32_t, int32_t, int32_t)> push_batch =
+        [&queue](const tl::request& req, int32_t region, int32_t seq, int32_t total_size) {
+            queue.Push({region, seq, total_size});
+        };
+    conn_ctx.engine.define("push_batch", push_batch).disable_response();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    tl::async_response stream_resp = stream.on(conn_ctx.endpoint).async(scan_ctx.uuid, pool->bulk(), num_credits);
+
+    // dictionaries are only sent when they change, so transfers are unpacked
+    // in the order they were packed rather than the order they were announced
+    UnpackState unpack_state;
+    std::map<int32_t, PushedTransfer> pending;
+    int32_t num_transfers = -1;
+    int32_t received = 0;
+    while (num_transfers == -1 || received < num_transfers) {
+        PushedTransfer t = queue.Pop();
+        if (t.region == kStreamError) {
+            stream_resp.wait();
+            conn_ctx.engine.finalize();
+            return arrow::Status::IOError("Server failed to stream the scan");
+        }
+        if (t.region == kEndOfStream) {
+            num_transfers = t.seq;
+            continue;
+        }
+
+        pending[t.seq] = t;
+        while (!pending.empty() && pending.begin()->first == received) {
+            PushedTransfer next = pending.begin()->second;
+            pending.erase(pending.begin());
+            std::shared_ptr<RegionLease> lease = pool->Lease(next.region);
+            arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> unpacked =
+                [&]() -> arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> {
+                    ARROW_ASSIGN_OR_RAISE(PackedTransfer layout, DecodeLayout(scan_ctx.schema, lease->data(), next.total_size));
+                    return UnpackLeasedTransfer(scan_ctx.schema, lease, layout, unpack_state);
+                }();
+            if (!unpacked.ok()) {
+                // the server keeps pushing until its reader runs out, hand the
+                // regions back until it says it is done so it never waits on a credit
+                lease.reset();
+                for (auto &p : pending) {
+                    pool->Lease(p.second.region);
+                }
+                while (num_transfers == -1) {
+                    PushedTransfer rest = queue.Pop();
+                    if (rest.region == kEndOfStream || rest.region == kStreamError) {
+                        break;
+                    }
+                    pool->Lease(rest.region);
+                }
+                stream_resp.wait();
+                conn_ctx.engine.finalize();
+                return unpacked.status();
+            }
+            std::vector<std::shared_ptr<arrow::RecordBatch>> batches = std::move(*unpacked);
+            total_batches += batches.size();
+            for (auto batch : batches) {
+                total_rows += batch->num_rows();
+            }
+            received++;
+        }
+    }
+    stream_resp.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "Read " << total_rows << " rows in " << std::to_string((double)std::chrono::duration_cast<std::chrono::microseconds>(end-start).count()/1000) << " ms" << std::endl;
+    conn_ctx.engine.finalize();
+    return arrow::Status::OK();
+}
+
+int main(int argc, char** argv) {
+    arrow::Status st = Main(argc, argv);
+    if (!st.ok()) {
+        std::cerr << "Error: " << st.ToString() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,154 @@
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <fstream>
+
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+#include "payload.h"
+#include "recv_pool.h"
+
+// copy of 7, pairs with the zero-copy server_9
+
+
+namespace tl = thallium;
+namespace cp = arrow::compute;
+
+
+const int32_t kTransferSize = 19 * 1024 * 1024;
+const int32_t kNumRegions = 4;
+
+
+arrow::Result<ScanReq> GetScanRequest(std::string path,
+                                      cp::Expression filter, 
+                                      std::shared_ptr<arrow::Schema> projection_schema,
+                                      std::shared_ptr<arrow::Schema> dataset_schema) {
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> filter_buff, arrow::compute::Serialize(filter));
+    ARROW_ASSIGN_OR_RAISE(auto projection_schema_buff, arrow::ipc::SerializeSchema(*projection_schema));
+    ARROW_ASSIGN_OR_RAISE(auto dataset_schema_buff, arrow::ipc::SerializeSchema(*dataset_schema));
+    ScanReqRPCStub stub(
+        path,
+        const_cast<uint8_t*>(filter_buff->data()), filter_buff->size(), 
+        const_cast<uint8_t*>(dataset_schema_buff->data()), dataset_schema_buff->size(),
+        const_cast<uint8_t*>(projection_schema_buff->data()), projection_schema_buff->size()
+    );
+    ScanReq req;
+    req.stub = stub;
+    req.schema = projection_schema;
+    req.buffers = {filter_buff, dataset_schema_buff, projection_schema_buff};
+    return req;
+}
+
+ConnCtx Init(std::string protocol, std::string host) {
+    ConnCtx ctx;
+    tl::engine engine(protocol, THALLIUM_SERVER_MODE, true);
+    tl::endpoint endpoint = engine.lookup(host);
+    ctx.engine = engine;
+    ctx.endpoint = endpoint;
+    return ctx;
+}
+
+std::shared_ptr<ReceivePool> pool;
+
+arrow::Result<ScanCtx> Scan(ConnCtx &conn_ctx, ScanReq &scan_req) {
+    tl::remote_procedure scan = conn_ctx.engine.define("scan");
+    PlanRespStub resp = scan.on(conn_ctx.endpoint)(scan_req.stub);
+    if (!resp.error.empty()) {
+        return arrow::Status::Invalid("Server rejected the scan: ", resp.error);
+    }
+    ScanCtx scan_ctx;
+    scan_ctx.uuid = resp.uuid;
+    scan_ctx.schema = scan_req.schema;
+    return scan_ctx;
+}
+
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> GetNextBatch(ConnCtx &conn_ctx, ScanCtx &scan_ctx, int32_t flag) {
+    tl::remote_procedure get_next_batch = conn_ctx.engine.define("get_next_batch");
+    ScanRespStubSeg resp = get_next_batch.on(conn_ctx.endpoint)(scan_ctx.uuid);
+    if (!resp.error.empty()) {
+        return arrow::Status::IOError("Server failed the scan: ", resp.error);
+    }
+
+    if (resp.batch_sizes.size() == 0) {
+        return std::vector<std::shared_ptr<arrow::RecordBatch>>();
+    }
+
+    if (flag == 1) {
+        pool = std::make_shared<ReceivePool>(conn_ctx.engine, kNumRegions, kTransferSize);
+    }
+
+    // pull every extent straight out of the server's slabs, back to back
+    std::shared_ptr<RegionLease> lease = pool->Acquire();
+    size_t pos = lease->offset();
+    for (int32_t e = 0; e < resp.extent_sizes.size(); e++) {
+        int32_t size = resp.extent_sizes[e];
+        resp.bulks[resp.extent_bulks[e]](resp.extent_offsets[e], size).on(conn_ctx.endpoint) >> pool->bulk()(pos, size);
+        pos += size;
+    }
+    return UnpackLeasedBatches(scan_ctx.schema, lease, resp);
+}
+
+arrow::Status Main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "./tc [uri]" << std::endl;
+        exit(1);
+    }
+
+    std::string uri = argv[1];
+
+    auto filter = 
+        cp::greater(cp::field_ref("total_amount"), cp::literal(-200));
+
+    auto schema = arrow::schema({
+        arrow::field("VendorID", arrow::int64()),
+        arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
+        arrow::field("tpep_dropoff_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
+        arrow::field("passenger_count", arrow::int64()),
+        arrow::field("trip_distance", arrow::float64()),
+        arrow::field("RatecodeID", arrow::int64()),
+        arrow::field("store_and_fwd_flag", arrow::utf8()),
+        arrow::field("PULocationID", arrow::int64()),
+        arrow::field("DOLocationID", arrow::int64()),
+        arrow::field("payment_type", arrow::int64()),
+        arrow::field("fare_amount", arrow::float64()),
+        arrow::field("extra", arrow::float64()),
+        arrow::field("mta_tax", arrow::float64()),
+        arrow::field("tip_amount", arrow::float64()),
+        arrow::field("tolls_amount", arrow::float64()),
+        arrow::field("improvement_surcharge", arrow::float64()),
+        arrow::field("total_amount", arrow::float64())
+    });
+
+    ConnCtx conn_ctx = Init("ofi+verbs", uri);
+    int64_t total_rows = 0;
+    int64_t total_batches = 0;
+
+    std::string path = "/mnt/cephfs/dataset";
+    ARROW_ASSIGN_OR_RAISE(auto scan_req, GetScanRequest(path, filter, schema, schema));
+    ARROW_ASSIGN_OR_RAISE(ScanCtx scan_ctx, Scan(conn_ctx, scan_req));
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+    auto start = std::chrono::high_resolution_clock::now();
+    while (true) {
+        ARROW_ASSIGN_OR_RAISE(batches, GetNextBatch(conn_ctx, scan_ctx, (total_rows == 0)));
+        if (batches.size() == 0) {
+            break;
+        }
+        total_batches += batches.size();
+        for (auto batch : batches) {
+            total_rows += batch->num_rows();
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "Read " << total_rows << " rows in " << std::to_string((double)std::chrono::duration_cast<std::chrono::microseconds>(end-start).count()/1000) << " ms" << std::endl;
+    conn_ctx.engine.finalize();
+    return arrow::Status::OK();
+}
+
+int main(int argc, char** argv) {
+    arrow::Status st = Main(argc, argv);
+    if (!st.ok()) {
+        std::cerr << "Error: " << st.ToString() << std::endl;
+        return 1;
+    }
+}
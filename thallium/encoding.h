@@ -0,0 +1,321 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "arrow_headers.h"
+
+
+// Lightweight encodings for the values of integer columns in a transfer.
+//
+//   kForBitpack: u64 reference (the minimum, widened to 64 bits), u8 bit
+//                width, then value - reference of every row packed LSB first
+//                into little endian 64-bit words, the last one cut to its bytes
+//   kRle:        runs of u32 length followed by the value in its own width
+//
+// Bit packing goes through blocks of 64 values, which take exactly bit width
+// words. Every bit width has its own pack and unpack kernel, unrolled from a
+// template so that the word and shift of every value are compile time
+// constants and nothing is carried from one value to the next. Taking the
+// reference off and adding it back are plain loops over a block. Run-length
+// encoding is a scalar loop, its runs have data dependent lengths.
+enum IntegerEncoding : int32_t {
+    kPlain = 0,
+    kForBitpack = 1,
+    kRle = 2,
+};
+
+// how a chunk of integers is going to be encoded
+struct EncodingPlan {
+    // integer storage of the column, width 0 if it has none
+    int32_t width = 0;
+    bool is_signed = true;
+    IntegerEncoding encoding = kPlain;
+    uint64_t reference = 0;
+    int32_t bit_width = 0;
+    int64_t num_runs = 0;
+    int64_t size = 0;
+};
+
+// byte width of the integer storage of `type`, 0 if it is not stored as integers
+int32_t IntegerWidth(const std::shared_ptr<arrow::DataType>& type, bool *is_signed) {
+    *is_signed = true;
+    switch (type->id()) {
+        case arrow::Type::INT8:
+            return 1;
+        case arrow::Type::INT16:
+            return 2;
+        case arrow::Type::INT32:
+        case arrow::Type::DATE32:
+        case arrow::Type::TIME32:
+            return 4;
+        case arrow::Type::INT64:
+        case arrow::Type::DATE64:
+        case arrow::Type::TIME64:
+        case arrow::Type::TIMESTAMP:
+        case arrow::Type::DURATION:
+            return 8;
+        default:
+            break;
+    }
+    *is_signed = false;
+    switch (type->id()) {
+        case arrow::Type::UINT8:
+            return 1;
+        case arrow::Type::UINT16:
+            return 2;
+        case arrow::Type::UINT32:
+            return 4;
+        case arrow::Type::UINT64:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+// values widened to 64 bits keep their order as unsigned differences
+template <typename T>
+uint64_t Widen(T value) {
+    if (std::is_signed<T>::value) {
+        return (uint64_t)(int64_t)value;
+    }
+    return (uint64_t)value;
+}
+
+template <typename T>
+EncodingPlan PlanEncoding(const T *values, int64_t length) {
+    EncodingPlan plan;
+    plan.size = length * sizeof(T);
+    if (length == 0) {
+        return plan;
+    }
+
+    T min = values[0], max = values[0];
+    int64_t num_runs = 1;
+    for (int64_t i = 1; i < length; i++) {
+        min = std::min(min, values[i]);
+        max = std::max(max, values[i]);
+        num_runs += values[i] != values[i - 1];
+    }
+
+    uint64_t range = Widen(max) - Widen(min);
+    int32_t bit_width = range == 0 ? 0 : 64 - __builtin_clzll(range);
+    int64_t for_size = 9 + (length * bit_width + 7) / 8;
+    int64_t rle_size = num_runs * (4 + sizeof(T));
+    if (for_size < plan.size && for_size <= rle_size) {
+        plan.encoding = kForBitpack;
+        plan.size = for_size;
+    } else if (rle_size < plan.size) {
+        plan.encoding = kRle;
+        plan.size = rle_size;
+    }
+    plan.reference = Widen(min);
+    plan.bit_width = bit_width;
+    plan.num_runs = num_runs;
+    return plan;
+}
+
+// values per bit-packed block, a block of bit width b takes b words
+const int64_t kPackBlock = 64;
+
+template <int B, size_t I>
+inline void PackValue(const uint64_t *in, uint64_t *out) {
+    constexpr int kWord = I * B / 64;
+    constexpr int kShift = I * B % 64;
+    out[kWord] |= in[I] << kShift;
+    if constexpr (kShift + B > 64) {
+        out[kWord + 1] |= in[I] >> (64 - kShift);
+    }
+}
+
+template <int B, size_t I>
+inline uint64_t UnpackValue(const uint64_t *in) {
+    constexpr int kWord = I * B / 64;
+    constexpr int kShift = I * B % 64;
+    constexpr uint64_t kMask = B == 64 ? ~0ULL : (1ULL << B) - 1;
+    uint64_t v = in[kWord] >> kShift;
+    if constexpr (kShift + B > 64) {
+        v |= in[kWord + 1] << (64 - kShift);
+    }
+    return v & kMask;
+}
+
+// packs the 64 values of `in`, each below 2^B, into the B words of `out`
+template <int B, size_t... I>
+void PackBlock(const uint64_t *in, uint64_t *out, std::index_sequence<I...>) {
+    std::fill(out, out + B, 0);
+    (PackValue<B, I>(in, out), ...);
+}
+
+template <int B, size_t... I>
+void UnpackBlock(const uint64_t *in, uint64_t *out, std::index_sequence<I...>) {
+    ((out[I] = UnpackValue<B, I>(in)), ...);
+}
+
+template <int B>
+void PackBlock(const uint64_t *in, uint64_t *out) {
+    PackBlock<B>(in, out, std::make_index_sequence<kPackBlock>());
+}
+
+template <int B>
+void UnpackBlock(const uint64_t *in, uint64_t *out) {
+    UnpackBlock<B>(in, out, std::make_index_sequence<kPackBlock>());
+}
+
+using BlockKernel = void (*)(const uint64_t*, uint64_t*);
+
+// kernels indexed by bit width, there is none for 0
+template <size_t... B>
+constexpr std::array<BlockKernel, 65> PackKernels(std::index_sequence<B...>) {
+    return {{nullptr, &PackBlock<B + 1>...}};
+}
+
+template <size_t... B>
+constexpr std::array<BlockKernel, 65> UnpackKernels(std::index_sequence<B...>) {
+    return {{nullptr, &UnpackBlock<B + 1>...}};
+}
+
+const std::array<BlockKernel, 65> kPackKernels = PackKernels(std::make_index_sequence<64>());
+const std::array<BlockKernel, 65> kUnpackKernels = UnpackKernels(std::make_index_sequence<64>());
+
+template <typename T>
+void EncodeIntegers(const T *values, int64_t length, const EncodingPlan& plan, uint8_t *out) {
+    if (plan.encoding == kForBitpack) {
+        memcpy(out, &plan.reference, sizeof(uint64_t));
+        out[8] = (uint8_t)plan.bit_width;
+        out += 9;
+        if (plan.bit_width == 0) {
+            return;
+        }
+        BlockKernel pack = kPackKernels[plan.bit_width];
+        int64_t block_bytes = plan.bit_width * sizeof(uint64_t);
+        uint64_t block[kPackBlock];
+        uint64_t words[kPackBlock];
+        int64_t i = 0;
+        for (; i + kPackBlock <= length; i += kPackBlock) {
+            for (int64_t j = 0; j < kPackBlock; j++) {
+                block[j] = Widen(values[i + j]) - plan.reference;
+            }
+            pack(block, words);
+            memcpy(out, words, block_bytes);
+            out += block_bytes;
+        }
+        // the last block is padded with zeros and cut to its bytes
+        int64_t rest = length - i;
+        if (rest > 0) {
+            for (int64_t j = 0; j < kPackBlock; j++) {
+                block[j] = j < rest ? Widen(values[i + j]) - plan.reference : 0;
+            }
+            pack(block, words);
+            memcpy(out, words, (rest * plan.bit_width + 7) / 8);
+        }
+    } else if (plan.encoding == kRle) {
+        int64_t start = 0;
+        for (int64_t i = 1; i <= length; i++) {
+            if (i == length || values[i] != values[start]) {
+                uint32_t run = i - start;
+                memcpy(out, &run, sizeof(run));
+                memcpy(out + sizeof(run), &values[start], sizeof(T));
+                out += sizeof(run) + sizeof(T);
+                start = i;
+            }
+        }
+    } else {
+        memcpy(out, values, length * sizeof(T));
+    }
+}
+
+template <typename T>
+arrow::Status DecodeIntegers(const uint8_t *in, int64_t size, IntegerEncoding encoding, int64_t length, T *out) {
+    const uint8_t *end = in + size;
+    if (encoding == kForBitpack) {
+        if (size < 9) {
+            return arrow::Status::Invalid("Truncated bit-packed column");
+        }
+        uint64_t reference;
+        memcpy(&reference, in, sizeof(reference));
+        int32_t bit_width = in[8];
+        in += 9;
+        if (bit_width > 64 || (end - in) < (length * bit_width + 7) / 8) {
+            return arrow::Status::Invalid("Truncated bit-packed column");
+        }
+        if (bit_width == 0) {
+            std::fill(out, out + length, (T)reference);
+            return arrow::Status::OK();
+        }
+        BlockKernel unpack = kUnpackKernels[bit_width];
+        int64_t block_bytes = bit_width * sizeof(uint64_t);
+        uint64_t words[kPackBlock];
+        uint64_t block[kPackBlock];
+        int64_t i = 0;
+        for (; i + kPackBlock <= length; i += kPackBlock) {
+            memcpy(words, in, block_bytes);
+            in += block_bytes;
+            unpack(words, block);
+            for (int64_t j = 0; j < kPackBlock; j++) {
+                out[i + j] = (T)(reference + block[j]);
+            }
+        }
+        int64_t rest = length - i;
+        if (rest > 0) {
+            memset(words, 0, block_bytes);
+            memcpy(words, in, (rest * bit_width + 7) / 8);
+            unpack(words, block);
+            for (int64_t j = 0; j < rest; j++) {
+                out[i + j] = (T)(reference + block[j]);
+            }
+        }
+    } else if (encoding == kRle) {
+        int64_t filled = 0;
+        while (filled < length) {
+            uint32_t run;
+            if (end - in < (int64_t)(sizeof(run) + sizeof(T))) {
+                return arrow::Status::Invalid("Truncated run-length column");
+            }
+            memcpy(&run, in, sizeof(run));
+            T value;
+            memcpy(&value, in + sizeof(run), sizeof(T));
+            in += sizeof(run) + sizeof(T);
+            if (run == 0 || run > length - filled) {
+                return arrow::Status::Invalid("Run-length column overflows its rows");
+            }
+            std::fill(out + filled, out + filled + run, value);
+            filled += run;
+        }
+    } else {
+        if (size != length * (int64_t)sizeof(T)) {
+            return arrow::Status::Invalid("Plain column of ", size, " bytes for ", length, " rows");
+        }
+        memcpy(out, in, size);
+    }
+    return arrow::Status::OK();
+}
+
+// runs `f` with a null pointer of the C type matching an integer storage
+template <typename F>
+auto DispatchInteger(int32_t width, bool is_signed, F&& f) {
+    switch (width) {
+        case 1: return is_signed ? f((int8_t*)nullptr) : f((uint8_t*)nullptr);
+        case 2: return is_signed ? f((int16_t*)nullptr) : f((uint16_t*)nullptr);
+        case 4: return is_signed ? f((int32_t*)nullptr) : f((uint32_t*)nullptr);
+        default: return is_signed ? f((int64_t*)nullptr) : f((uint64_t*)nullptr);
+    }
+}
+
+// picks the encoding of the values of `span`, a plain plan for non integer columns
+EncodingPlan PlanColumnEncoding(const std::shared_ptr<arrow::DataType>& type, const uint8_t *data, int64_t length) {
+    bool is_signed;
+    int32_t width = IntegerWidth(type, &is_signed);
+    EncodingPlan plan;
+    if (width > 0) {
+        plan = DispatchInteger(width, is_signed, [&](auto *tag) {
+            return PlanEncoding((decltype(tag))data, length);
+        });
+    }
+    plan.width = width;
+    plan.is_signed = is_signed;
+    return plan;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <margo.h>
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+
+
+namespace tl = thallium;
+
+
+// How an engine drives Mercury progress. Small transfers are dominated by
+// the time from a completion landing to the ULT waiting on it being woken,
+// which depends on whether progress has an xstream of its own and whether
+// it blocks in the NIC's wait or spins on it.
+struct EngineConfig {
+    // run the progress loop on a dedicated xstream instead of the primary one
+    bool progress_thread = true;
+    // poll the network without ever blocking (NA_NO_BLOCK and a zero progress
+    // timeout), trades a core for wake-up latency
+    bool busy_spin = false;
+    // xstreams for handlers defined without a pool of their own, 0 runs
+    // them next to the progress loop
+    int32_t rpc_threads = 0;
+    // a margo JSON configuration used verbatim instead of the fields above
+    std::string json;
+
+    std::string ToJson() const {
+        if (!json.empty()) {
+            return json;
+        }
+        std::stringstream ss;
+        ss << "{";
+        ss << "\"use_progress_thread\": " << (progress_thread ? "true" : "false") << ", ";
+        ss << "\"rpc_thread_count\": " << rpc_threads;
+        if (busy_spin) {
+            ss << ", \"progress_timeout_ub_msec\": 0";
+            ss << ", \"mercury\": {\"na_no_block\": true}";
+        }
+        ss << "}";
+        return ss.str();
+    }
+
+    std::string ToString() const {
+        if (!json.empty()) {
+            return "json";
+        }
+        return "progress=" + std::to_string(progress_thread) + ",spin=" + std::to_string(busy_spin) +
+               ",handlers=" + std::to_string(rpc_threads);
+    }
+};
+
+// `spec` is either the path of a margo JSON file (ending in .json) or a
+// comma separated list out of progress=0|1, spin=0|1 and handlers=N
+arrow::Result<EngineConfig> ParseEngineConfig(const std::string& spec) {
+    EngineConfig config;
+    if (spec.size() > 5 && spec.compare(spec.size() - 5, 5, ".json") == 0) {
+        std::ifstream file(spec);
+        if (!file) {
+            return arrow::Status::IOError("Can't read engine config ", spec);
+        }
+        std::stringstream ss;
+        ss << file.rdbuf();
+        config.json = ss.str();
+        return config;
+    }
+
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            return arrow::Status::Invalid("Engine setting without a value: ", item);
+        }
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+        if (key == "progress") {
+            config.progress_thread = value == "1";
+        } else if (key == "spin") {
+            config.busy_spin = value == "1";
+        } else if (key == "handlers") {
+            config.rpc_threads = std::stoi(value);
+        } else {
+            return arrow::Status::Invalid("Unknown engine setting ", key);
+        }
+    }
+    return config;
+}
+
+tl::engine MakeEngine(const std::string& protocol, int mode, const EngineConfig& config) {
+    std::string json = config.ToJson();
+    struct margo_init_info info = {};
+    info.json_config = json.c_str();
+    return tl::engine(protocol, mode, &info);
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arrow/util/byte_size.h>
+
+#include "arrow_headers.h"
+#include "transfer.h"
+
+
+// IPC framing of the ring slots, the alternative to PackBatches. A scan is
+// one Arrow IPC stream cut at message boundaries: the schema message opens
+// the first transfer, dictionaries show up in front of the batch that first
+// needs them, and every transfer is a whole number of messages. Clients feed
+// the received regions to one arrow::ipc::StreamDecoder per scan, which
+// slices the batches out of them without copying. Body compression is the
+// IPC one (lz4 or zstd on every buffer), not the adaptive CompressTransfer.
+
+// room kept free in a slot for the schema and dictionary messages
+const int64_t kIpcReserve = 64 * 1024;
+
+// the write options of an IPC mode scan, `compression` is none, lz4 or zstd
+arrow::Result<arrow::ipc::IpcWriteOptions> MakeIpcWriteOptions(const std::string& compression) {
+    arrow::ipc::IpcWriteOptions options = arrow::ipc::IpcWriteOptions::Defaults();
+    if (compression == "none") {
+        return options;
+    }
+    ARROW_ASSIGN_OR_RAISE(arrow::Compression::type type, arrow::util::Codec::GetCompressionType(compression));
+    if (type != arrow::Compression::LZ4_FRAME && type != arrow::Compression::ZSTD) {
+        return arrow::Status::Invalid("IPC body compression is lz4 or zstd, got ", compression);
+    }
+    ARROW_ASSIGN_OR_RAISE(options.codec, arrow::util::Codec::Create(type));
+    return options;
+}
+
+// An OutputStream over whichever ring slot is being filled, so the stream
+// writer of a scan outlives the slots it writes into
+class SlotOutputStream : public arrow::io::OutputStream {
+    public:
+        void Reset(uint8_t *buffer, int64_t capacity) {
+            buffer_ = buffer;
+            capacity_ = capacity;
+            position_ = 0;
+        }
+
+        arrow::Status Write(const void *data, int64_t nbytes) override {
+            if (position_ + nbytes > capacity_) {
+                return arrow::Status::CapacityError("IPC messages overflow a ", capacity_, " byte transfer");
+            }
+            memcpy(buffer_ + position_, data, nbytes);
+            position_ += nbytes;
+            return arrow::Status::OK();
+        }
+        using arrow::io::OutputStream::Write;
+
+        // the writer only looks at this once, every message it writes is a
+        // multiple of 8 bytes so alignment carries over between slots
+        arrow::Result<int64_t> Tell() const override { return position_; }
+
+        arrow::Status Close() override {
+            closed_ = true;
+            return arrow::Status::OK();
+        }
+
+        bool closed() const override { return closed_; }
+
+    private:
+        uint8_t *buffer_ = nullptr;
+        int64_t capacity_ = 0;
+        int64_t position_ = 0;
+        bool closed_ = false;
+};
+
+// encapsulated size of `batch`, counting its dictionaries in case they have
+// to be sent along; bodies are measured uncompressed, lz4 and zstd frames
+// only grow incompressible buffers by a few bytes
+int64_t IpcBatchSize(const std::shared_ptr<arrow::RecordBatch>& batch) {
+    int64_t size = 0;
+    if (!arrow::ipc::GetRecordBatchSize(*batch, &size).ok()) {
+        return std::numeric_limits<int32_t>::max();
+    }
+    size += batch->num_columns() * 3 * 64;
+    for (int32_t i = 0; i < batch->num_columns(); i++) {
+        std::shared_ptr<arrow::ArrayData> dictionary = batch->column_data(i)->dictionary;
+        if (dictionary != nullptr) {
+            size += arrow::util::TotalBufferSize(*dictionary) + 1024;
+        }
+    }
+    return size;
+}
+
+// ProduceTransfers for the IPC format
+void ProduceIpcTransfers(TransferRing& ring, std::shared_ptr<arrow::RecordBatchReader> reader, TransferSizer& sizer,
+                         const arrow::ipc::IpcWriteOptions& options) {
+    TransferSource source(reader, IpcBatchSize);
+    std::shared_ptr<SlotOutputStream> sink = std::make_shared<SlotOutputStream>();
+    std::shared_ptr<arrow::ipc::RecordBatchWriter> writer;
+    while (true) {
+        TransferRing::Slot *slot = ring.AcquireFree();
+        if (slot == nullptr) {
+            break;
+        }
+        arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> batches =
+            source.Next(sizer.Target(), ring.SlotSize() - kIpcReserve);
+        if (!batches.ok()) {
+            ring.Close(batches.status());
+            return;
+        }
+        if (batches->size() == 0) {
+            break;
+        }
+
+        sink->Reset(slot->buffer, ring.SlotSize());
+        arrow::Status status;
+        if (writer == nullptr) {
+            arrow::Result<std::shared_ptr<arrow::ipc::RecordBatchWriter>> made =
+                arrow::ipc::MakeStreamWriter(sink, reader->schema(), options);
+            status = made.status();
+            if (made.ok()) {
+                writer = *made;
+            }
+        }
+        for (auto &batch : *batches) {
+            if (!status.ok()) {
+                break;
+            }
+            status = writer->WriteRecordBatch(*batch);
+        }
+        if (!status.ok()) {
+            ring.Close(status);
+            return;
+        }
+        slot->transfer = PackedTransfer();
+        slot->transfer.total_size = sink->Tell().ValueOrDie();
+        ring.Publish();
+    }
+    // no end of stream marker, the scan ends with an empty response as usual
+    ring.Close();
+}
+
+// The client side of an IPC mode scan. The decoded batches reference the
+// buffers handed to Read, so passing a LeasedBuffer keeps the region leased
+// for as long as one of them lives.
+class IpcTransferReader {
+    public:
+        IpcTransferReader() : collector_(std::make_shared<Collector>()), decoder_(collector_) {}
+
+        arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> Read(std::shared_ptr<arrow::Buffer> transfer) {
+            ARROW_RETURN_NOT_OK(decoder_.Consume(std::move(transfer)));
+            std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+            batches.swap(collector_->batches);
+            return batches;
+        }
+
+    private:
+        class Collector : public arrow::ipc::Listener {
+            public:
+                arrow::Status OnRecordBatchDecoded(std::shared_ptr<arrow::RecordBatch> batch) override {
+                    batches.push_back(std::move(batch));
+                    return arrow::Status::OK();
+                }
+
+                std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        };
+
+        std::shared_ptr<Collector> collector_;
+        arrow::ipc::StreamDecoder decoder_;
+};
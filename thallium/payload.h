@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <vector>
 #include <string>
@@ -6,6 +8,7 @@
 #include <thallium/serialization/stl/string.hpp>
 #include <thallium/serialization/stl/vector.hpp>
 
+#include <arrow/buffer.h>
 #include <arrow/compute/expression.h>
 
 namespace tl = thallium;
@@ -19,6 +22,8 @@ struct ConnCtx {
 struct ScanCtx {
     std::string uuid;
     std::shared_ptr<arrow::Schema> schema;  
+    // how long the server keeps the scan of a silent client, 0 for ever
+    int32_t lease_seconds = 0;
 };
 
 class ScanRespStub {
@@ -47,6 +52,67 @@ class ScanRespStub {
         }
 };
 
+// What the row group statistics of the scanned files let the server skip
+// before reading anything
+class ScanStats {
+    public:
+        int64_t row_groups = 0;
+        int64_t row_groups_skipped = 0;
+        int64_t bytes = 0;
+        int64_t bytes_skipped = 0;
+
+        template<class A>
+        void serialize(A& ar) {
+            ar & row_groups;
+            ar & row_groups_skipped;
+            ar & bytes;
+            ar & bytes_skipped;
+        }
+};
+
+// A transfer that carries its own layout header (see PackBatches), so only
+// its size goes over RPC; total_size 0 marks the end of the scan, a failed
+// one when `error` is set. With `unknown_scan` the server no longer has the
+// scan: it finished, was cancelled or its lease ran out.
+class ScanRespStubPacked {
+    public:
+        int32_t total_size = 0;
+        tl::bulk bulk;
+        // small transfers travel in the response itself and leave bulk empty
+        std::string inline_data;
+        // how the bytes are framed, a TransferFormat
+        int32_t format = 0;
+        // position of the transfer in the scan, responses to concurrent
+        // requests can come back in any order
+        int64_t seq = 0;
+        // filled in on the end of the scan
+        ScanStats stats;
+        std::string error;
+        bool unknown_scan = false;
+
+        ScanRespStubPacked() {}
+        ScanRespStubPacked(int32_t total_size, tl::bulk bulk)
+            : total_size(total_size), bulk(bulk) {}
+
+        template<class A>
+        void serialize(A& ar) {
+            ar & total_size;
+            ar & bulk;
+            ar & inline_data;
+            ar & format;
+            ar & seq;
+            ar & stats;
+            ar & error;
+            ar & unknown_scan;
+        }
+};
+
+// what push_batch carries in place of a region number: the end of the
+// stream, with the number of transfers in place of the sequence number, or
+// a scan the server could not stream
+const int32_t kEndOfStream = -1;
+const int32_t kStreamError = -2;
+
 class ScanRespStubPush {
     public:
         std::vector<int32_t> data_offsets;
@@ -71,6 +137,102 @@ class ScanRespStubPush {
         }
 };
 
+// Describes a transfer whose buffers stay where the scanner put them. The
+// client pulls the extents one after the other into consecutive bytes of its
+// receive region; the offsets/sizes vectors refer to that packed region.
+class ScanRespStubSeg {
+    public:
+        std::vector<int32_t> data_offsets;
+        std::vector<int32_t> data_sizes;
+        std::vector<int32_t> off_offsets;
+        std::vector<int32_t> off_sizes;
+        std::vector<int32_t> batch_sizes;
+        int32_t total_size = 0;
+
+        std::vector<int32_t> extent_bulks;
+        std::vector<int64_t> extent_offsets;
+        std::vector<int32_t> extent_sizes;
+        std::vector<tl::bulk> bulks;
+        // set when the scan failed, the rest is then empty
+        std::string error;
+
+        ScanRespStubSeg() {}
+
+        template<class A>
+        void serialize(A& ar) {
+            ar & data_offsets;
+            ar & data_sizes;
+            ar & off_offsets;
+            ar & off_sizes;
+            ar & batch_sizes;
+            ar & total_size;
+            ar & extent_bulks;
+            ar & extent_offsets;
+            ar & extent_sizes;
+            ar & bulks;
+            ar & error;
+        }
+};
+
+// An aggregate the server computes over the rows of a scan instead of
+// sending them: sum, count, mean, min or max of `column`, output as `name`
+class AggregateSpec {
+    public:
+        std::string function;
+        std::string column;
+        std::string name;
+
+        AggregateSpec() {}
+        AggregateSpec(std::string function, std::string column, std::string name)
+            : function(function), column(column), name(name) {}
+
+        template<typename A>
+        void save(A& ar) const {
+            ar & function;
+            ar & column;
+            ar & name;
+        }
+
+        template<typename A>
+        void load(A& ar) {
+            ar & function;
+            ar & column;
+            ar & name;
+        }
+};
+
+// How the server decodes a dataset scan, zeros leave Arrow's defaults.
+// With use_threads the fragments are decoded on Arrow's CPU pool, up to
+// fragment_readahead of them and batch_readahead batches each at once;
+// unordered output hands batches out as they are decoded instead of in
+// file order.
+class ScanTuning {
+    public:
+        bool use_threads = false;
+        int64_t batch_size = 0;
+        int32_t batch_readahead = 0;
+        int32_t fragment_readahead = 0;
+        bool ordered = true;
+
+        template<typename A>
+        void save(A& ar) const {
+            ar & use_threads;
+            ar & batch_size;
+            ar & batch_readahead;
+            ar & fragment_readahead;
+            ar & ordered;
+        }
+
+        template<typename A>
+        void load(A& ar) {
+            ar & use_threads;
+            ar & batch_size;
+            ar & batch_readahead;
+            ar & fragment_readahead;
+            ar & ordered;
+        }
+};
+
 class ScanReqRPCStub {
     public:
         uint8_t *filter_buffer;
@@ -84,6 +246,13 @@ class ScanReqRPCStub {
 
         std::string path;
 
+        // optional, the scan then yields one row per group (a single row
+        // without group_by) of these aggregates instead of the matching rows
+        std::vector<AggregateSpec> aggregates;
+        std::vector<std::string> group_by;
+
+        ScanTuning tuning;
+
         ScanReqRPCStub() {}
         ScanReqRPCStub(
             std::string path,
@@ -107,6 +276,10 @@ class ScanReqRPCStub {
 
             ar & projection_schema_buffer_size;
             ar.write(projection_schema_buffer, projection_schema_buffer_size);
+
+            ar & aggregates;
+            ar & group_by;
+            ar & tuning;
         }
 
         template<typename A>
@@ -124,10 +297,57 @@ class ScanReqRPCStub {
             ar & projection_schema_buffer_size;
             projection_schema_buffer = new uint8_t[projection_schema_buffer_size];
             ar.read(projection_schema_buffer, projection_schema_buffer_size);
+
+            ar & aggregates;
+            ar & group_by;
+            ar & tuning;
+        }
+};
+
+// A serialized Substrait plan whose named tables are read from the dataset
+// under `path`. Small plans travel in `plan`, larger ones are pulled from the
+// client through `bulk`.
+class PlanReqRPCStub {
+    public:
+        std::string path;
+        std::string plan;
+        int64_t plan_size = 0;
+        tl::bulk bulk;
+
+        PlanReqRPCStub() {}
+
+        template<class A>
+        void serialize(A& ar) {
+            ar & path;
+            ar & plan;
+            ar & plan_size;
+            ar & bulk;
+        }
+};
+
+// The scan a scan, scan_aggregate or scan_plan call opened, empty uuid and
+// an error message when it was rejected; `schema` is the IPC serialized
+// schema of the output of plans and aggregations. Clients renew the lease
+// well within `lease_seconds`.
+class PlanRespStub {
+    public:
+        std::string uuid;
+        std::string schema;
+        std::string error;
+        int32_t lease_seconds = 0;
+
+        template<class A>
+        void serialize(A& ar) {
+            ar & uuid;
+            ar & schema;
+            ar & error;
+            ar & lease_seconds;
         }
 };
 
 struct ScanReq {
     ScanReqRPCStub stub;
     std::shared_ptr<arrow::Schema> schema;
+    // the stub only points into these
+    std::vector<std::shared_ptr<arrow::Buffer>> buffers;
 };
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arrow/acero/api.h>
+#include <arrow/engine/api.h>
+
+#include "arrow_headers.h"
+#include "payload.h"
+#include "catalog.h"
+
+
+namespace ac = arrow::acero;
+namespace cp = arrow::compute;
+
+
+// The parquet files under `path` as a scan node, with the columns and types
+// the plan declared for its named table. The plan's own filter and project
+// relations run on top of it. The files come from `catalog`, so a plan
+// doesn't list the dataset again unless it changed.
+arrow::Result<ac::Declaration> ScanNamedTable(const std::string& path, const arrow::Schema& schema, DatasetCatalog *catalog) {
+    ARROW_ASSIGN_OR_RAISE(auto discovered, catalog->Get("file://" + path));
+    ARROW_ASSIGN_OR_RAISE(auto dataset, discovered->ReplaceSchema(std::make_shared<arrow::Schema>(schema)));
+
+    auto scan_options = std::make_shared<arrow::dataset::ScanOptions>();
+    ARROW_ASSIGN_OR_RAISE(auto projection,
+        arrow::dataset::ProjectionDescr::FromNames(schema.field_names(), *dataset->schema()));
+    arrow::dataset::SetProjection(scan_options.get(), std::move(projection));
+
+    // the scan node appends fragment and batch indices the plan doesn't know about
+    std::vector<cp::Expression> fields;
+    for (const std::string& name : schema.field_names()) {
+        fields.push_back(cp::field_ref(name));
+    }
+    return ac::Declaration::Sequence({
+        {"scan", arrow::dataset::ScanNodeOptions(dataset, scan_options)},
+        {"project", ac::ProjectNodeOptions(std::move(fields), schema.field_names())},
+    });
+}
+
+// Runs a serialized Substrait plan on Acero, every named table of it being
+// the dataset under `path`. Batches come out of the reader as the plan's
+// sink produces them, an aggregation only once it has seen all its input.
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ExecutePlan(const arrow::Buffer& plan, const std::string& path,
+                                                                     DatasetCatalog *catalog) {
+    arrow::engine::ConversionOptions options;
+    options.named_table_provider = [path, catalog](const std::vector<std::string>& names, const arrow::Schema& schema) {
+        return ScanNamedTable(path, schema, catalog);
+    };
+    return arrow::engine::ExecuteSerializedPlan(plan, nullptr, nullptr, options);
+}
+
+// The aggregates of a scan as one Acero plan. The scan node decodes the
+// fragments in parallel on the CPU pool and the aggregate node keeps a
+// partial state per thread that it merges at the end, so the output is a
+// single small batch: the group_by columns, then the aggregates.
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> AggregateDataset(
+        const std::shared_ptr<arrow::dataset::Dataset>& dataset, const cp::Expression& filter,
+        const std::vector<AggregateSpec>& aggregates, const std::vector<std::string>& group_by) {
+    // only the keys, the aggregated columns and what the filter needs are read
+    std::vector<std::string> columns = group_by;
+    for (const AggregateSpec& spec : aggregates) {
+        if (std::find(columns.begin(), columns.end(), spec.column) == columns.end()) {
+            columns.push_back(spec.column);
+        }
+    }
+    for (const arrow::FieldRef& ref : cp::FieldsInExpression(filter)) {
+        const std::string *name = ref.name();
+        if (name != nullptr && std::find(columns.begin(), columns.end(), *name) == columns.end()) {
+            columns.push_back(*name);
+        }
+    }
+    auto scan_options = std::make_shared<arrow::dataset::ScanOptions>();
+    scan_options->filter = filter;
+    ARROW_ASSIGN_OR_RAISE(auto projection, arrow::dataset::ProjectionDescr::FromNames(columns, *dataset->schema()));
+    arrow::dataset::SetProjection(scan_options.get(), std::move(projection));
+
+    // grouped aggregates are the hash_ variants of the same kernels
+    std::vector<cp::Aggregate> aggs;
+    std::vector<std::string> names = group_by;
+    for (const AggregateSpec& spec : aggregates) {
+        std::string function = group_by.empty() ? spec.function : "hash_" + spec.function;
+        aggs.emplace_back(function, nullptr, arrow::FieldRef(spec.column), spec.name);
+        names.push_back(spec.name);
+    }
+    std::vector<arrow::FieldRef> keys(group_by.begin(), group_by.end());
+
+    // the column order of the aggregate node differs between Arrow versions
+    std::vector<cp::Expression> fields;
+    for (const std::string& name : names) {
+        fields.push_back(cp::field_ref(name));
+    }
+    ac::Declaration plan = ac::Declaration::Sequence({
+        {"scan", arrow::dataset::ScanNodeOptions(dataset, scan_options)},
+        {"filter", ac::FilterNodeOptions(filter)},
+        {"aggregate", ac::AggregateNodeOptions(std::move(aggs), std::move(keys))},
+        {"project", ac::ProjectNodeOptions(std::move(fields), names)},
+    });
+    ARROW_ASSIGN_OR_RAISE(std::unique_ptr<arrow::RecordBatchReader> reader, ac::DeclarationToReader(std::move(plan), /*use_threads=*/true));
+    return std::shared_ptr<arrow::RecordBatchReader>(std::move(reader));
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+#include "payload.h"
+#include "session.h"
+#include "ipc_transfer.h"
+
+
+namespace tl = thallium;
+
+
+// The client side of a get_next_batch scan with read-ahead. A fetch ULT on
+// its own xstream keeps up to `depth` get_next_batch calls in flight as
+// async responses, pulls every bulk transfer into a region of its own and
+// decodes it, so the server packs and the NIC moves the next transfers
+// while the caller works on the current one. Transfers are handed out in
+// scan order whatever order the responses come back in. The region pool is
+// the back-pressure: with every region held by undelivered or unreleased
+// batches the fetch ULT waits.
+class PrefetchingScan {
+    public:
+        using Batches = std::vector<std::shared_ptr<arrow::RecordBatch>>;
+
+        PrefetchingScan(ThalliumSession& session, tl::endpoint endpoint, ScanCtx scan_ctx)
+            : session_(session), endpoint_(std::move(endpoint)), scan_ctx_(std::move(scan_ctx)), depth_(session.depth()),
+              pool_(session.pool()), striped_(session.striped()),
+              get_next_batch_(session.get_next_batch()),
+              xstream_(tl::xstream::create()) {
+            session_.OpenScan(scan_ctx_.uuid, endpoint_, scan_ctx_.lease_seconds);
+            thread_ = xstream_->make_thread([this]() {
+                Fetch();
+            });
+        }
+
+        // a scan left before its end is cancelled, the server frees its
+        // reader and ring and answers the calls still in flight right away
+        ~PrefetchingScan() {
+            bool cancel;
+            {
+                std::unique_lock<tl::mutex> lock(mutex_);
+                stopped_ = true;
+                cancel = !done_;
+                ready_.clear();
+            }
+            if (cancel) {
+                session_.cancel_scan().on(endpoint_)(scan_ctx_.uuid);
+            }
+            thread_->join();
+            xstream_->join();
+            session_.CloseScan(scan_ctx_.uuid);
+        }
+
+        // the batches of the next transfer, empty at the end of the scan; a
+        // scan the server failed ends with its error instead
+        arrow::Result<Batches> Next() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            while (ready_.empty() && !done_) {
+                cv_.wait(lock);
+            }
+            if (ready_.empty()) {
+                ARROW_RETURN_NOT_OK(status_);
+                return Batches();
+            }
+            arrow::Result<Batches> batches = std::move(ready_.front());
+            ready_.pop_front();
+            return batches;
+        }
+
+        // what the server's row group pruning skipped, known once Next()
+        // returned the end of the scan
+        ScanStats stats() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            return stats_;
+        }
+
+        // runs `callback` on every transfer of the scan, in order
+        arrow::Status ForEach(std::function<arrow::Status(const Batches&)> callback) {
+            while (true) {
+                ARROW_ASSIGN_OR_RAISE(Batches batches, Next());
+                if (batches.empty()) {
+                    return arrow::Status::OK();
+                }
+                ARROW_RETURN_NOT_OK(callback(batches));
+            }
+        }
+
+    private:
+        // every request tells the server which slots it may refill
+        void Issue() {
+            inflight_.push_back(get_next_batch_.on(endpoint_).async(scan_ctx_.uuid, released_));
+            released_.clear();
+        }
+
+        arrow::Result<Batches> Receive(ScanRespStubPacked& resp) {
+            if (!resp.inline_data.empty()) {
+                std::shared_ptr<arrow::Buffer> inline_buff = arrow::Buffer::FromString(std::move(resp.inline_data));
+                if (resp.format == kIpcFormat) {
+                    return ipc_reader_.Read(inline_buff);
+                }
+                ARROW_ASSIGN_OR_RAISE(PackedTransfer layout, DecodeLayout(scan_ctx_.schema, inline_buff->data(), inline_buff->size()));
+                return UnpackTransfer(scan_ctx_.schema, layout, unpack_state_, [inline_buff](int32_t offset, int32_t size) {
+                    return arrow::SliceBuffer(inline_buff, offset, size);
+                });
+            }
+
+            // the returned batches keep this region leased, so it is never
+            // overwritten while someone still holds one of them
+            std::shared_ptr<RegionLease> lease = pool_->Acquire();
+            striped_->Pull(resp.bulk, 0, endpoint_, pool_->bulk(), lease->offset(), resp.total_size);
+            released_.push_back(resp.seq);
+            if (resp.format == kIpcFormat) {
+                return ipc_reader_.Read(std::make_shared<LeasedBuffer>(lease, 0, resp.total_size));
+            }
+            ARROW_ASSIGN_OR_RAISE(PackedTransfer layout, DecodeLayout(scan_ctx_.schema, lease->data(), resp.total_size));
+            return UnpackLeasedTransfer(scan_ctx_.schema, lease, layout, unpack_state_);
+        }
+
+        void Fetch() {
+            // no more requests once the server reported the end or the caller left
+            bool ended = false;
+            bool stopped = false;
+            // a request handled after the one that saw the end finds the scan
+            // gone too, that only means it was lost when nothing saw the end
+            bool finished = false;
+            std::string lost;
+            for (int32_t i = 0; i < depth_; i++) {
+                Issue();
+            }
+            while (!inflight_.empty()) {
+                ScanRespStubPacked resp = inflight_.front().wait();
+                inflight_.pop_front();
+                {
+                    std::unique_lock<tl::mutex> lock(mutex_);
+                    stopped = stopped_;
+                }
+                ended = ended || stopped;
+                if (resp.total_size == 0) {
+                    ended = true;
+                    if (resp.unknown_scan) {
+                        lost = resp.error;
+                        continue;
+                    }
+                    finished = true;
+                    if (!resp.error.empty()) {
+                        std::unique_lock<tl::mutex> lock(mutex_);
+                        status_ = arrow::Status::IOError("Server failed the scan: ", resp.error);
+                    }
+                    // only the ends answered while the server still had the scan carry them
+                    if (resp.stats.row_groups > 0) {
+                        std::unique_lock<tl::mutex> lock(mutex_);
+                        stats_ = resp.stats;
+                    }
+                    continue;
+                }
+                arrived_[resp.seq] = std::move(resp);
+                while (!arrived_.empty() && arrived_.begin()->first == next_seq_) {
+                    ScanRespStubPacked &next = arrived_.begin()->second;
+                    if (stopped) {
+                        // nobody is reading anymore, hand the slot back unpulled
+                        if (next.inline_data.empty()) {
+                            released_.push_back(next.seq);
+                        }
+                    } else {
+                        arrow::Result<Batches> batches = Receive(next);
+                        std::unique_lock<tl::mutex> lock(mutex_);
+                        ready_.push_back(std::move(batches));
+                        cv_.notify_all();
+                    }
+                    arrived_.erase(arrived_.begin());
+                    next_seq_++;
+                }
+                if (!ended) {
+                    Issue();
+                }
+            }
+            // the end of the scan can overtake the last pulls, the server
+            // keeps the scan's ring until it learns about them
+            if (!released_.empty()) {
+                Issue();
+                inflight_.front().wait();
+                inflight_.pop_front();
+            }
+            std::unique_lock<tl::mutex> lock(mutex_);
+            if (!finished && !lost.empty()) {
+                status_ = arrow::Status::IOError("Server lost the scan: ", lost);
+            }
+            done_ = true;
+            cv_.notify_all();
+        }
+
+        ThalliumSession& session_;
+        tl::endpoint endpoint_;
+        ScanCtx scan_ctx_;
+        int32_t depth_;
+        std::shared_ptr<ReceivePool> pool_;
+        std::shared_ptr<StripedRdma> striped_;
+        tl::remote_procedure get_next_batch_;
+
+        // owned by the fetch ULT
+        std::deque<tl::async_response> inflight_;
+        std::map<int64_t, ScanRespStubPacked> arrived_;
+        int64_t next_seq_ = 0;
+        std::vector<int64_t> released_;
+        UnpackState unpack_state_;
+        IpcTransferReader ipc_reader_;
+
+        tl::mutex mutex_;
+        tl::condition_variable cv_;
+        std::deque<arrow::Result<Batches>> ready_;
+        ScanStats stats_;
+        // the error the server ended the scan with
+        arrow::Status status_;
+        bool stopped_ = false;
+        bool done_ = false;
+
+        tl::managed<tl::xstream> xstream_;
+        tl::managed<tl::thread> thread_;
+};
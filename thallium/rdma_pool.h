@@ -0,0 +1,243 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <mutex>
+
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+
+
+namespace tl = thallium;
+
+
+// An arrow::MemoryPool carving allocations out of a fixed set of large slabs
+// that are exposed once at startup. Anything the scanner decodes into this
+// pool can be described to the client as (slab bulk, offset, size) and pulled
+// directly, without the memcpy into a transfer segment.
+//
+// Slabs are only ever exposed from the ULT that creates the pool; when they
+// are full, or an allocation needs more than kAlignment, allocations fall
+// back to the default pool and Locate() reports them as unregistered so the
+// caller can copy them instead, or register them itself: LocateFallback()
+// gives the allocation holding such an address, and the free listener hears
+// of every fallback allocation before it goes back.
+class RdmaMemoryPool : public arrow::MemoryPool {
+    public:
+        RdmaMemoryPool(tl::engine& engine, int32_t num_slabs, int64_t slab_size)
+            : slab_size_(slab_size), fallback_(arrow::default_memory_pool()) {
+            slabs_.resize(num_slabs);
+            for (int32_t i = 0; i < num_slabs; i++) {
+                Slab &slab = slabs_[i];
+                slab.data = (uint8_t*)aligned_alloc(kAlignment, slab_size);
+                std::vector<std::pair<void*,std::size_t>> segments(1);
+                segments[0].first = (void*)slab.data;
+                segments[0].second = slab_size;
+                slab.bulk = engine.expose(segments, tl::bulk_mode::read_only);
+                slab.free_blocks[0] = slab_size;
+                slab_index_[(uintptr_t)slab.data] = i;
+            }
+        }
+
+        arrow::Status Allocate(int64_t size, int64_t alignment, uint8_t** out) override {
+            if (size == 0) {
+                *out = zero_size_area_;
+                return arrow::Status::OK();
+            }
+            int64_t rounded = RoundUp(size);
+            // blocks are only kAlignment aligned, anything stricter comes from the fallback
+            if (alignment <= kAlignment) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &slab : slabs_) {
+                    for (auto it = slab.free_blocks.begin(); it != slab.free_blocks.end(); ++it) {
+                        if (it->second < rounded) {
+                            continue;
+                        }
+                        int64_t offset = it->first;
+                        int64_t remaining = it->second - rounded;
+                        slab.free_blocks.erase(it);
+                        if (remaining > 0) {
+                            slab.free_blocks[offset + rounded] = remaining;
+                        }
+                        *out = slab.data + offset;
+                        bytes_allocated_ += rounded;
+                        total_bytes_allocated_ += rounded;
+                        num_allocations_++;
+                        max_memory_ = std::max(max_memory_, bytes_allocated_);
+                        return arrow::Status::OK();
+                    }
+                }
+            }
+            ARROW_RETURN_NOT_OK(fallback_->Allocate(size, alignment, out));
+            std::lock_guard<std::mutex> lock(mutex_);
+            fallback_bytes_ += size;
+            fallback_allocations_[(uintptr_t)*out] = size;
+            return arrow::Status::OK();
+        }
+
+        arrow::Status Reallocate(int64_t old_size, int64_t new_size, int64_t alignment, uint8_t** ptr) override {
+            if (*ptr == zero_size_area_) {
+                return Allocate(new_size, alignment, ptr);
+            }
+            int32_t slab;
+            int64_t offset;
+            if (!Locate(*ptr, &slab, &offset)) {
+                NotifyFree(*ptr);
+                uint8_t *old = *ptr;
+                ARROW_RETURN_NOT_OK(fallback_->Reallocate(old_size, new_size, alignment, ptr));
+                std::lock_guard<std::mutex> lock(mutex_);
+                fallback_bytes_ += new_size - old_size;
+                fallback_allocations_.erase((uintptr_t)old);
+                fallback_allocations_[(uintptr_t)*ptr] = new_size;
+                return arrow::Status::OK();
+            }
+            if (RoundUp(new_size) == RoundUp(old_size)) {
+                return arrow::Status::OK();
+            }
+            uint8_t *out;
+            ARROW_RETURN_NOT_OK(Allocate(new_size, alignment, &out));
+            memcpy(out, *ptr, std::min(old_size, new_size));
+            Free(*ptr, old_size, alignment);
+            *ptr = out;
+            return arrow::Status::OK();
+        }
+
+        void Free(uint8_t* buffer, int64_t size, int64_t alignment) override {
+            if (buffer == zero_size_area_) {
+                return;
+            }
+            int32_t slab_idx;
+            int64_t offset;
+            if (!Locate(buffer, &slab_idx, &offset)) {
+                NotifyFree(buffer);
+                fallback_->Free(buffer, size, alignment);
+                std::lock_guard<std::mutex> lock(mutex_);
+                fallback_bytes_ -= size;
+                fallback_allocations_.erase((uintptr_t)buffer);
+                return;
+            }
+            int64_t rounded = RoundUp(size);
+            std::lock_guard<std::mutex> lock(mutex_);
+            bytes_allocated_ -= rounded;
+
+            // coalesce with the following and the preceding free block
+            std::map<int64_t, int64_t> &blocks = slabs_[slab_idx].free_blocks;
+            auto next = blocks.lower_bound(offset);
+            if (next != blocks.end() && next->first == offset + rounded) {
+                rounded += next->second;
+                next = blocks.erase(next);
+            }
+            if (next != blocks.begin()) {
+                auto prev = std::prev(next);
+                if (prev->first + prev->second == offset) {
+                    prev->second += rounded;
+                    return;
+                }
+            }
+            blocks[offset] = rounded;
+        }
+
+        // maps an address to the slab holding it and the offset inside that slab
+        bool Locate(const uint8_t* addr, int32_t* slab, int64_t* offset) const {
+            auto it = slab_index_.upper_bound((uintptr_t)addr);
+            if (it == slab_index_.begin()) {
+                return false;
+            }
+            --it;
+            int64_t off = (uintptr_t)addr - it->first;
+            if (off >= slab_size_) {
+                return false;
+            }
+            *slab = it->second;
+            *offset = off;
+            return true;
+        }
+
+        // the live fallback allocation holding `addr`
+        bool LocateFallback(const uint8_t* addr, const uint8_t** base, int64_t* size) const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = fallback_allocations_.upper_bound((uintptr_t)addr);
+            if (it == fallback_allocations_.begin()) {
+                return false;
+            }
+            --it;
+            if ((uintptr_t)addr >= it->first + it->second) {
+                return false;
+            }
+            *base = (const uint8_t*)it->first;
+            *size = it->second;
+            return true;
+        }
+
+        // called with the start of a fallback allocation right before it is
+        // freed or reallocated, set before the pool is used
+        void SetFreeListener(std::function<void(const uint8_t*)> listener) {
+            free_listener_ = std::move(listener);
+        }
+
+        int32_t num_slabs() const { return slabs_.size(); }
+        const uint8_t* SlabData(int32_t slab) const { return slabs_[slab].data; }
+        int64_t SlabSize() const { return slab_size_; }
+        const tl::bulk& SlabBulk(int32_t slab) const { return slabs_[slab].bulk; }
+
+        int64_t bytes_allocated() const override {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return bytes_allocated_ + fallback_bytes_;
+        }
+
+        int64_t total_bytes_allocated() const override {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return total_bytes_allocated_;
+        }
+
+        int64_t num_allocations() const override {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return num_allocations_;
+        }
+
+        int64_t max_memory() const override {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return max_memory_;
+        }
+
+        std::string backend_name() const override { return "rdma"; }
+
+    private:
+        static constexpr int64_t kAlignment = 64;
+
+        struct Slab {
+            uint8_t *data;
+            tl::bulk bulk;
+            // offset -> size of every free block, kept coalesced
+            std::map<int64_t, int64_t> free_blocks;
+        };
+
+        static int64_t RoundUp(int64_t size) {
+            return (size + kAlignment - 1) & ~(kAlignment - 1);
+        }
+
+        void NotifyFree(const uint8_t* buffer) {
+            if (free_listener_) {
+                free_listener_(buffer);
+            }
+        }
+
+        int64_t slab_size_;
+        std::vector<Slab> slabs_;
+        std::map<uintptr_t, int32_t> slab_index_;
+        arrow::MemoryPool *fallback_;
+        std::function<void(const uint8_t*)> free_listener_;
+
+        mutable std::mutex mutex_;
+        int64_t bytes_allocated_ = 0;
+        // what this pool got from the fallback, not what the fallback holds overall
+        int64_t fallback_bytes_ = 0;
+        // start -> size of every live fallback allocation
+        std::map<uintptr_t, int64_t> fallback_allocations_;
+        int64_t total_bytes_allocated_ = 0;
+        int64_t num_allocations_ = 0;
+        int64_t max_memory_ = 0;
+
+        alignas(kAlignment) uint8_t zero_size_area_[1];
+};
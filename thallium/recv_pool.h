@@ -0,0 +1,133 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+#include "transfer.h"
+
+
+namespace tl = thallium;
+
+
+class ReceivePool;
+
+// Exclusive ownership of one receive region. The region goes back to the pool
+// when the last lease reference is dropped, which must happen on a ULT since
+// it may wake a waiter or send the credit back.
+class RegionLease {
+    public:
+        RegionLease(std::shared_ptr<ReceivePool> pool, int32_t region, uint8_t *data, size_t offset)
+            : pool_(std::move(pool)), region_(region), data_(data), offset_(offset) {}
+        ~RegionLease();
+
+        int32_t region() const { return region_; }
+        uint8_t *data() const { return data_; }
+        // offset of the region inside the pool's bulk
+        size_t offset() const { return offset_; }
+
+    private:
+        std::shared_ptr<ReceivePool> pool_;
+        int32_t region_;
+        uint8_t *data_;
+        size_t offset_;
+};
+
+// A buffer that keeps its region leased for as long as any array references it.
+class LeasedBuffer : public arrow::Buffer {
+    public:
+        LeasedBuffer(std::shared_ptr<RegionLease> lease, int64_t offset, int64_t size)
+            : arrow::Buffer(lease->data() + offset, size), lease_(std::move(lease)) {}
+
+    private:
+        std::shared_ptr<RegionLease> lease_;
+};
+
+// A set of receive regions carved out of a single buffer that is exposed once.
+// Without `on_release` regions are handed out locally through Acquire() and
+// come back to the free list. With `on_release` the regions belong to the
+// server (e.g. as push credits), are wrapped with Lease() when it writes to
+// one, and `on_release` hands them back.
+class ReceivePool : public std::enable_shared_from_this<ReceivePool> {
+    public:
+        ReceivePool(tl::engine& engine, int32_t num_regions, size_t region_size,
+                    std::function<void(int32_t)> on_release = nullptr)
+            : region_size_(region_size), on_release_(std::move(on_release)) {
+            segments_.resize(1);
+            segments_[0].first = malloc(num_regions * region_size);
+            segments_[0].second = num_regions * region_size;
+            bulk_ = engine.expose(segments_, tl::bulk_mode::write_only);
+            if (!on_release_) {
+                for (int32_t i = 0; i < num_regions; i++) {
+                    free_regions_.push_back(i);
+                }
+            }
+        }
+
+        // the region memory goes only once it is no longer exposed
+        ~ReceivePool() {
+            bulk_ = tl::bulk();
+            free(segments_[0].first);
+        }
+
+        tl::bulk& bulk() { return bulk_; }
+        size_t region_size() const { return region_size_; }
+
+        // blocks until some previously returned batches are released
+        std::shared_ptr<RegionLease> Acquire() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            while (free_regions_.empty()) {
+                cv_.wait(lock);
+            }
+            int32_t region = free_regions_.front();
+            free_regions_.pop_front();
+            return Lease(region);
+        }
+
+        std::shared_ptr<RegionLease> Lease(int32_t region) {
+            size_t offset = region * region_size_;
+            return std::make_shared<RegionLease>(
+                shared_from_this(), region, (uint8_t*)segments_[0].first + offset, offset);
+        }
+
+        void Release(int32_t region) {
+            if (on_release_) {
+                on_release_(region);
+                return;
+            }
+            std::unique_lock<tl::mutex> lock(mutex_);
+            free_regions_.push_back(region);
+            cv_.notify_one();
+        }
+
+    private:
+        std::vector<std::pair<void*,std::size_t>> segments_;
+        tl::bulk bulk_;
+        size_t region_size_;
+        std::function<void(int32_t)> on_release_;
+
+        tl::mutex mutex_;
+        tl::condition_variable cv_;
+        std::deque<int32_t> free_regions_;
+};
+
+RegionLease::~RegionLease() { pool_->Release(region_); }
+
+// zero-copy unpack, every column buffer holds a reference on `lease`
+template <typename Layout>
+std::vector<std::shared_ptr<arrow::RecordBatch>> UnpackLeasedBatches(std::shared_ptr<arrow::Schema> schema, std::shared_ptr<RegionLease> lease, const Layout& resp) {
+    return UnpackBatchesWith(schema, resp, [lease](int32_t offset, int32_t size) -> std::shared_ptr<arrow::Buffer> {
+        return std::make_shared<LeasedBuffer>(lease, offset, size);
+    });
+}
+
+// zero-copy unpack of a transfer in the layout of PackBatches, except for
+// dictionaries and compressed buffers
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> UnpackLeasedTransfer(std::shared_ptr<arrow::Schema> schema, std::shared_ptr<RegionLease> lease,
+                                                                                     const PackedTransfer& layout, UnpackState& state) {
+    return UnpackTransfer(schema, layout, state, [lease](int32_t offset, int32_t size) -> std::shared_ptr<arrow::Buffer> {
+        return std::make_shared<LeasedBuffer>(lease, offset, size);
+    });
+}
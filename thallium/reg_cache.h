@@ -0,0 +1,168 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+
+#include <thallium.hpp>
+
+#include "rdma_pool.h"
+
+
+namespace tl = thallium;
+
+
+// Remembers which address ranges are exposed so that a buffer in them is not
+// registered again.
+//
+// Pinned ranges (the slabs of an RdmaMemoryPool) stay for good: the pool
+// never hands their memory back. Fallback allocations of that pool are
+// exposed whole on first use and kept until the pool frees or reallocates
+// them, so every buffer sliced out of one allocation (a column of an
+// in-memory table, say) shares a single registration. Transfers still
+// holding a Ref keep a dropped registration alive until they are done.
+// Anything else may be freed and reused by an allocator the cache does not
+// see (kernel outputs, mapped files), so it is registered page aligned for
+// the transfer that asks for it and deregistered when the last reference of
+// that transfer goes.
+class RegistrationCache {
+    public:
+        struct Entry {
+            uintptr_t base;
+            size_t size;
+            tl::bulk bulk;
+            bool pinned = false;
+        };
+
+        // keeps an entry, and with it its registration, alive
+        class Ref {
+            public:
+                Ref(std::shared_ptr<Entry> entry, int64_t offset)
+                    : entry_(std::move(entry)), offset_(offset) {}
+
+                const tl::bulk& bulk() const { return entry_->bulk; }
+                const Entry* entry() const { return entry_.get(); }
+                // offset of the requested address inside bulk()
+                int64_t offset() const { return offset_; }
+
+            private:
+                std::shared_ptr<Entry> entry_;
+                int64_t offset_;
+        };
+
+        // `pool` is the pool whose fallback allocations get cached, if any
+        RegistrationCache(tl::engine& engine, RdmaMemoryPool *pool = nullptr)
+            : engine_(engine), pool_(pool) {
+            if (pool_ != nullptr) {
+                pool_->SetFreeListener([this](const uint8_t* base) {
+                    Invalidate(base);
+                });
+            }
+        }
+
+        void Pin(const uint8_t* addr, size_t size, tl::bulk bulk) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto entry = std::make_shared<Entry>();
+            entry->base = (uintptr_t)addr;
+            entry->size = size;
+            entry->bulk = bulk;
+            entry->pinned = true;
+            entries_[entry->base] = entry;
+        }
+
+        std::shared_ptr<Ref> Acquire(const uint8_t* addr, size_t size) {
+            uintptr_t start = (uintptr_t)addr;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::shared_ptr<Entry> entry = Find(entries_, start, size);
+                if (entry == nullptr) {
+                    entry = Find(allocations_, start, size);
+                }
+                if (entry != nullptr) {
+                    hits_++;
+                    return std::make_shared<Ref>(entry, start - entry->base);
+                }
+                misses_++;
+            }
+
+            // the pool's lock is never taken under ours, its free listener takes ours
+            const uint8_t *alloc_base;
+            int64_t alloc_size;
+            bool cached = pool_ != nullptr && pool_->LocateFallback(addr, &alloc_base, &alloc_size) &&
+                          start + size <= (uintptr_t)alloc_base + alloc_size;
+            std::shared_ptr<Entry> entry = cached ? Expose((uintptr_t)alloc_base, alloc_size) : Expose(start, size);
+            if (cached) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                // another transfer may have exposed the same allocation meanwhile
+                auto inserted = allocations_.emplace((uintptr_t)alloc_base, entry);
+                entry = inserted.first->second;
+            }
+            return std::make_shared<Ref>(entry, start - entry->base);
+        }
+
+        // forgets the registration of the fallback allocation at `base`
+        void Invalidate(const uint8_t* base) {
+            std::shared_ptr<Entry> entry;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = allocations_.find((uintptr_t)base);
+                if (it == allocations_.end()) {
+                    return;
+                }
+                entry = std::move(it->second);
+                allocations_.erase(it);
+            }
+            // deregistered here unless a transfer still holds it
+        }
+
+        // buffers found in a pinned range or a cached allocation, and ones
+        // that needed a registration
+        int64_t hits() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return hits_;
+        }
+
+        int64_t misses() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return misses_;
+        }
+
+    private:
+        static constexpr uintptr_t kPageSize = 4096;
+
+        // [start, start + size) widened to whole pages
+        std::shared_ptr<Entry> Expose(uintptr_t start, size_t size) {
+            auto entry = std::make_shared<Entry>();
+            entry->base = start & ~(kPageSize - 1);
+            entry->size = ((start + size + kPageSize - 1) & ~(kPageSize - 1)) - entry->base;
+            std::vector<std::pair<void*,std::size_t>> segments(1);
+            segments[0].first = (void*)entry->base;
+            segments[0].second = entry->size;
+            entry->bulk = engine_.expose(segments, tl::bulk_mode::read_only);
+            return entry;
+        }
+
+        // entries are keyed by the start of what they were asked to cover,
+        // which page alignment may have moved base below
+        static std::shared_ptr<Entry> Find(const std::map<uintptr_t, std::shared_ptr<Entry>>& entries,
+                                           uintptr_t start, size_t size) {
+            auto it = entries.upper_bound(start);
+            if (it == entries.begin()) {
+                return nullptr;
+            }
+            --it;
+            if (it->second->base + it->second->size < start + size) {
+                return nullptr;
+            }
+            return it->second;
+        }
+
+        tl::engine engine_;
+        RdmaMemoryPool *pool_;
+        // pinned slabs
+        std::map<uintptr_t, std::shared_ptr<Entry>> entries_;
+        // start of a live fallback allocation -> its registration
+        std::map<uintptr_t, std::shared_ptr<Entry>> allocations_;
+        mutable std::mutex mutex_;
+        int64_t hits_ = 0;
+        int64_t misses_ = 0;
+};
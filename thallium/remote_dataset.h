@@ -0,0 +1,282 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <thallium.hpp>
+
+#include <arrow/util/async_generator.h>
+
+#include "arrow_headers.h"
+#include "payload.h"
+#include "session.h"
+#include "prefetch.h"
+
+
+namespace tl = thallium;
+namespace cp = arrow::compute;
+
+
+// the scan request for `path`, the stub points into the returned buffers
+arrow::Result<ScanReq> MakeScanRequest(const std::string& path, const cp::Expression& filter,
+                                       std::shared_ptr<arrow::Schema> projection_schema,
+                                       std::shared_ptr<arrow::Schema> dataset_schema,
+                                       const ScanTuning& tuning = ScanTuning()) {
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> filter_buff, cp::Serialize(filter));
+    ARROW_ASSIGN_OR_RAISE(auto projection_schema_buff, arrow::ipc::SerializeSchema(*projection_schema));
+    ARROW_ASSIGN_OR_RAISE(auto dataset_schema_buff, arrow::ipc::SerializeSchema(*dataset_schema));
+    ScanReq req;
+    req.stub = ScanReqRPCStub(
+        path,
+        const_cast<uint8_t*>(filter_buff->data()), filter_buff->size(),
+        const_cast<uint8_t*>(dataset_schema_buff->data()), dataset_schema_buff->size(),
+        const_cast<uint8_t*>(projection_schema_buff->data()), projection_schema_buff->size()
+    );
+    req.stub.tuning = tuning;
+    req.schema = projection_schema;
+    req.buffers = {filter_buff, dataset_schema_buff, projection_schema_buff};
+    return req;
+}
+
+// opens a scan of `path` on the server
+arrow::Result<ScanCtx> StartRemoteScan(ThalliumSession& session, const tl::endpoint& endpoint, const std::string& path, const cp::Expression& filter,
+                                       std::shared_ptr<arrow::Schema> projection_schema,
+                                       std::shared_ptr<arrow::Schema> dataset_schema,
+                                       const ScanTuning& tuning = ScanTuning()) {
+    ARROW_ASSIGN_OR_RAISE(ScanReq req, MakeScanRequest(path, filter, projection_schema, dataset_schema, tuning));
+    PlanRespStub resp = session.scan().on(endpoint)(req.stub);
+    if (!resp.error.empty()) {
+        return arrow::Status::Invalid("Server rejected the scan: ", resp.error);
+    }
+    ScanCtx scan_ctx;
+    scan_ctx.uuid = resp.uuid;
+    scan_ctx.schema = projection_schema;
+    scan_ctx.lease_seconds = resp.lease_seconds;
+    return scan_ctx;
+}
+
+// has the server list the dataset at `uri` again instead of trusting its
+// catalog, the number of files it found or -1
+int64_t RefreshRemoteDataset(ThalliumSession& session, const tl::endpoint& endpoint, const std::string& uri) {
+    return session.refresh().on(endpoint)(uri);
+}
+
+// the scan a scan_aggregate or scan_plan call opened, with its output schema
+arrow::Result<ScanCtx> OpenedScan(PlanRespStub resp) {
+    if (!resp.error.empty()) {
+        return arrow::Status::Invalid("Server rejected the scan: ", resp.error);
+    }
+    arrow::io::BufferReader reader(arrow::Buffer::FromString(std::move(resp.schema)));
+    arrow::ipc::DictionaryMemo memo;
+    ScanCtx scan_ctx;
+    scan_ctx.uuid = resp.uuid;
+    scan_ctx.lease_seconds = resp.lease_seconds;
+    ARROW_ASSIGN_OR_RAISE(scan_ctx.schema, arrow::ipc::ReadSchema(&reader, &memo));
+    return scan_ctx;
+}
+
+// opens a scan of `path` that yields `aggregates` per `group_by` group
+// instead of the rows matching `filter`
+arrow::Result<ScanCtx> StartRemoteAggregate(ThalliumSession& session, const tl::endpoint& endpoint, const std::string& path,
+                                            const cp::Expression& filter, std::shared_ptr<arrow::Schema> dataset_schema,
+                                            std::vector<AggregateSpec> aggregates, std::vector<std::string> group_by) {
+    ARROW_ASSIGN_OR_RAISE(ScanReq req, MakeScanRequest(path, filter, dataset_schema, dataset_schema));
+    req.stub.aggregates = std::move(aggregates);
+    req.stub.group_by = std::move(group_by);
+    PlanRespStub resp = session.scan_aggregate().on(endpoint)(req.stub);
+    return OpenedScan(std::move(resp));
+}
+
+// plans up to this size go in the request, larger ones are pulled by the server
+const int64_t kInlinePlanSize = 32 * 1024;
+
+// starts a serialized Substrait plan over the dataset at `path` on the server,
+// the scan it opens has the plan's output schema
+arrow::Result<ScanCtx> StartRemotePlan(ThalliumSession& session, const tl::endpoint& endpoint, const std::string& path,
+                                       const std::shared_ptr<arrow::Buffer>& plan) {
+    PlanReqRPCStub stub;
+    stub.path = path;
+    stub.plan_size = plan->size();
+    if (plan->size() <= kInlinePlanSize) {
+        stub.plan = plan->ToString();
+    } else {
+        std::vector<std::pair<void*, size_t>> segments = {{const_cast<uint8_t*>(plan->data()), (size_t)plan->size()}};
+        stub.bulk = session.engine().expose(segments, tl::bulk_mode::read_only);
+    }
+    PlanRespStub resp = session.scan_plan().on(endpoint)(stub);
+    return OpenedScan(std::move(resp));
+}
+
+// A remote scan as a RecordBatchReader, one batch at a time out of the
+// transfers a PrefetchingScan reads ahead
+class ThalliumRecordBatchReader : public arrow::RecordBatchReader {
+    public:
+        ThalliumRecordBatchReader(ThalliumSession& session, const tl::endpoint& endpoint, ScanCtx scan_ctx)
+            : schema_(scan_ctx.schema),
+              scan_(std::make_unique<PrefetchingScan>(session, endpoint, scan_ctx)) {}
+
+        static arrow::Result<std::shared_ptr<ThalliumRecordBatchReader>> Make(ThalliumSession& session, const tl::endpoint& endpoint,
+                                                                             const std::string& path,
+                                                                             const cp::Expression& filter,
+                                                                             std::shared_ptr<arrow::Schema> projection_schema,
+                                                                             std::shared_ptr<arrow::Schema> dataset_schema,
+                                                                             const ScanTuning& tuning = ScanTuning()) {
+            ARROW_ASSIGN_OR_RAISE(ScanCtx scan_ctx, StartRemoteScan(session, endpoint, path, filter, projection_schema, dataset_schema, tuning));
+            return std::make_shared<ThalliumRecordBatchReader>(session, endpoint, std::move(scan_ctx));
+        }
+
+        // the aggregates of a scan, computed on the server
+        static arrow::Result<std::shared_ptr<ThalliumRecordBatchReader>> MakeAggregate(ThalliumSession& session, const tl::endpoint& endpoint,
+                                                                                      const std::string& path,
+                                                                                      const cp::Expression& filter,
+                                                                                      std::shared_ptr<arrow::Schema> dataset_schema,
+                                                                                      std::vector<AggregateSpec> aggregates,
+                                                                                      std::vector<std::string> group_by) {
+            ARROW_ASSIGN_OR_RAISE(ScanCtx scan_ctx, StartRemoteAggregate(session, endpoint, path, filter, dataset_schema,
+                                                                         std::move(aggregates), std::move(group_by)));
+            return std::make_shared<ThalliumRecordBatchReader>(session, endpoint, std::move(scan_ctx));
+        }
+
+        // the output of a Substrait plan run on the server
+        static arrow::Result<std::shared_ptr<ThalliumRecordBatchReader>> MakeFromPlan(ThalliumSession& session, const tl::endpoint& endpoint,
+                                                                                     const std::string& path,
+                                                                                     const std::shared_ptr<arrow::Buffer>& plan) {
+            ARROW_ASSIGN_OR_RAISE(ScanCtx scan_ctx, StartRemotePlan(session, endpoint, path, plan));
+            return std::make_shared<ThalliumRecordBatchReader>(session, endpoint, std::move(scan_ctx));
+        }
+
+        std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+        arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch>* batch) override {
+            while (pending_.empty()) {
+                if (scan_ == nullptr) {
+                    *batch = nullptr;
+                    return arrow::Status::OK();
+                }
+                ARROW_ASSIGN_OR_RAISE(PrefetchingScan::Batches batches, scan_->Next());
+                if (batches.empty()) {
+                    stats_ = scan_->stats();
+                    scan_.reset();
+                }
+                pending_.insert(pending_.end(), batches.begin(), batches.end());
+            }
+            *batch = std::move(pending_.front());
+            pending_.pop_front();
+            return arrow::Status::OK();
+        }
+
+        // what the server skipped, complete once the reader is exhausted
+        const ScanStats& stats() const { return stats_; }
+
+        arrow::Status Close() override {
+            scan_.reset();
+            pending_.clear();
+            return arrow::Status::OK();
+        }
+
+    private:
+        std::shared_ptr<arrow::Schema> schema_;
+        std::unique_ptr<PrefetchingScan> scan_;
+        std::deque<std::shared_ptr<arrow::RecordBatch>> pending_;
+        ScanStats stats_;
+};
+
+// the columns of `dataset_schema` that the filter or the projection of a
+// scan touch, in dataset order; the scan node evaluates both again on top
+arrow::Result<std::shared_ptr<arrow::Schema>> PushdownSchema(const arrow::dataset::ScanOptions& options,
+                                                             const std::shared_ptr<arrow::Schema>& dataset_schema) {
+    std::vector<bool> needed(dataset_schema->num_fields(), false);
+    for (const cp::Expression *expr : {&options.filter, &options.projection}) {
+        if (!expr->is_valid()) {
+            continue;
+        }
+        for (const arrow::FieldRef& ref : cp::FieldsInExpression(*expr)) {
+            ARROW_ASSIGN_OR_RAISE(arrow::FieldPath path, ref.FindOne(*dataset_schema));
+            needed[path[0]] = true;
+        }
+    }
+    arrow::FieldVector fields;
+    for (int32_t i = 0; i < dataset_schema->num_fields(); i++) {
+        if (needed[i]) {
+            fields.push_back(dataset_schema->field(i));
+        }
+    }
+    // a scan that reads no column still needs the row counts
+    if (fields.empty() && dataset_schema->num_fields() > 0) {
+        fields.push_back(dataset_schema->field(0));
+    }
+    return arrow::schema(fields);
+}
+
+// Everything under one dataset path of the server. Filter and projection are
+// pushed into the scan request; batches come out of a background generator
+// whose bounded queue stops the reads when the plan falls behind, and the
+// prefetch stalls behind it once the receive regions are all in use.
+class RemoteFragment : public arrow::dataset::Fragment {
+    public:
+        RemoteFragment(std::shared_ptr<ThalliumSession> session, tl::endpoint endpoint, std::string path, std::shared_ptr<arrow::Schema> schema)
+            : arrow::dataset::Fragment(cp::literal(true), std::move(schema)),
+              session_(std::move(session)), endpoint_(std::move(endpoint)), path_(std::move(path)) {}
+
+        std::string type_name() const override { return "thallium"; }
+
+        arrow::Result<arrow::dataset::RecordBatchGenerator> ScanBatchesAsync(
+                const std::shared_ptr<arrow::dataset::ScanOptions>& options) override {
+            ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Schema> projection_schema, PushdownSchema(*options, physical_schema_));
+            // the server decodes the way the local scan was asked to, in file order
+            ScanTuning tuning;
+            tuning.use_threads = options->use_threads;
+            tuning.batch_size = options->batch_size;
+            tuning.batch_readahead = options->batch_readahead;
+            tuning.fragment_readahead = options->fragment_readahead;
+            ARROW_ASSIGN_OR_RAISE(std::shared_ptr<ThalliumRecordBatchReader> reader,
+                                  ThalliumRecordBatchReader::Make(*session_, endpoint_, path_, options->filter, projection_schema, physical_schema_, tuning));
+            auto batches = arrow::MakeFunctionIterator([reader]() -> arrow::Result<std::shared_ptr<arrow::RecordBatch>> {
+                std::shared_ptr<arrow::RecordBatch> batch;
+                ARROW_RETURN_NOT_OK(reader->ReadNext(&batch));
+                return batch;
+            });
+            return arrow::MakeBackgroundGenerator(std::move(batches), arrow::io::default_io_context().executor(), kReadAhead);
+        }
+
+    protected:
+        arrow::Result<std::shared_ptr<arrow::Schema>> ReadPhysicalSchemaImpl() override { return physical_schema_; }
+
+    private:
+        // decoded batches queued ahead of the plan
+        static const int kReadAhead = 8;
+
+        std::shared_ptr<ThalliumSession> session_;
+        tl::endpoint endpoint_;
+        std::string path_;
+};
+
+// A dataset served by a thallium scan server. The server scans everything
+// under `path` for a request, so the whole dataset is a single fragment;
+// splitting it up would have every fragment return all the rows.
+class RemoteDataset : public arrow::dataset::Dataset {
+    public:
+        RemoteDataset(std::shared_ptr<ThalliumSession> session, tl::endpoint endpoint, std::string path,
+                      std::shared_ptr<arrow::Schema> schema)
+            : arrow::dataset::Dataset(std::move(schema)),
+              session_(std::move(session)), endpoint_(std::move(endpoint)), path_(std::move(path)) {}
+
+        std::string type_name() const override { return "thallium"; }
+
+        arrow::Result<std::shared_ptr<arrow::dataset::Dataset>> ReplaceSchema(std::shared_ptr<arrow::Schema> schema) const override {
+            return std::make_shared<RemoteDataset>(session_, endpoint_, path_, std::move(schema));
+        }
+
+    protected:
+        arrow::Result<arrow::dataset::FragmentIterator> GetFragmentsImpl(cp::Expression predicate) override {
+            arrow::dataset::FragmentVector fragments = {std::make_shared<RemoteFragment>(session_, endpoint_, path_, schema_)};
+            return arrow::MakeVectorIterator(std::move(fragments));
+        }
+
+    private:
+        std::shared_ptr<ThalliumSession> session_;
+        tl::endpoint endpoint_;
+        std::string path_;
+};
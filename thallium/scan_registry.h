@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <boost/uuid/uuid_io.hpp>
+
+#include <thallium.hpp>
+
+
+namespace tl = thallium;
+
+
+// The open scans of a server, keyed by uuid. Handlers of different clients
+// run concurrently, so every access goes through the lock; the state itself
+// is shared_ptr owned so a handler keeps it alive after looking it up.
+// Every lookup renews the lease of a scan, RemoveExpired hands back the
+// ones nobody asked about for longer than the lease.
+template <typename State>
+class ScanRegistry {
+    public:
+        std::string Add(std::shared_ptr<State> state) {
+            std::string uuid = boost::uuids::to_string(boost::uuids::random_generator()());
+            std::unique_lock<tl::mutex> lock(mutex_);
+            scans_[uuid] = Entry{std::move(state), std::chrono::steady_clock::now()};
+            return uuid;
+        }
+
+        // nullptr if the scan is unknown or already finished
+        std::shared_ptr<State> Get(const std::string& uuid) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            auto it = scans_.find(uuid);
+            if (it == scans_.end()) {
+                return nullptr;
+            }
+            it->second.last_seen = std::chrono::steady_clock::now();
+            return it->second.state;
+        }
+
+        // false if the scan is unknown, its lease is gone for good then
+        bool Touch(const std::string& uuid) {
+            return Get(uuid) != nullptr;
+        }
+
+        std::shared_ptr<State> Remove(const std::string& uuid) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            auto it = scans_.find(uuid);
+            if (it == scans_.end()) {
+                return nullptr;
+            }
+            std::shared_ptr<State> state = std::move(it->second.state);
+            scans_.erase(it);
+            return state;
+        }
+
+        std::vector<std::shared_ptr<State>> RemoveExpired(std::chrono::steady_clock::duration lease) {
+            std::vector<std::shared_ptr<State>> expired;
+            auto now = std::chrono::steady_clock::now();
+            std::unique_lock<tl::mutex> lock(mutex_);
+            for (auto it = scans_.begin(); it != scans_.end();) {
+                if (now - it->second.last_seen > lease) {
+                    expired.push_back(std::move(it->second.state));
+                    it = scans_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            return expired;
+        }
+
+        size_t Size() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            return scans_.size();
+        }
+
+    private:
+        struct Entry {
+            std::shared_ptr<State> state;
+            std::chrono::steady_clock::time_point last_seen;
+        };
+
+        tl::mutex mutex_;
+        std::unordered_map<std::string, Entry> scans_;
+};
@@ -0,0 +1,406 @@
+#include <iostream>
+#include <fstream>
+#include <map>
+
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+#include "ace.h"
+#include "transfer.h"
+#include "ipc_transfer.h"
+#include "scan_registry.h"
+#include "engine_config.h"
+#include "plan.h"
+
+// pipelined version of 4, scan/pack/RDMA of consecutive transfers overlap.
+// serves concurrent clients, every scan owns a ring from a shared pool and
+// the handlers run on their own xstreams. besides filtered scans it runs
+// aggregations (scan_aggregate) and Substrait plans (scan_plan) and serves
+// their output the same way
+
+namespace tl = thallium;
+namespace cp = arrow::compute;
+
+
+const int32_t kTransferSize = 19 * 1024 * 1024;
+const int32_t kMinTransferSize = 1024 * 1024;
+// transfers up to this size are copied into the response instead of pulled,
+// Mercury still moves them in one message well past its eager size
+const int32_t kInlineThreshold = 32 * 1024;
+
+
+// clients that neither ask for a transfer nor send keep_alive for this long
+// are taken for gone and their scans are reclaimed
+const int32_t kLeaseSeconds = 60;
+
+// Substrait plans pulled from the client are at most this large, the size
+// comes from the request
+const int64_t kMaxPlanSize = 16 * 1024 * 1024;
+
+
+// everything a scan needs between two get_next_batch calls. The ring goes
+// back to the pool with the last reference, so a handler still holding the
+// state of a cancelled scan never touches a ring that serves another one.
+struct ScanState {
+    ScanState(std::shared_ptr<arrow::RecordBatchReader> reader, RingPool *ring_pool)
+        : reader(std::move(reader)), ring_pool(ring_pool), ring(ring_pool->Acquire()),
+          sizer(kTransferSize, kMinTransferSize, kTransferSize) {
+        ring->Reset();
+    }
+
+    ~ScanState() {
+        ring_pool->Release(ring);
+    }
+
+    std::shared_ptr<arrow::RecordBatchReader> reader;
+    // what row group pruning saved, sent with the end of the scan
+    ScanStats stats;
+    RingPool *ring_pool;
+    TransferRing *ring;
+    TransferSizer sizer;
+
+    // the time from handing out a transfer to the client releasing it is
+    // what it spent pulling plus one round trip, which is what the sizer has
+    // to amortize. Prefetching clients have several transfers out at once.
+    void Served(int64_t seq, int32_t bytes) {
+        std::unique_lock<tl::mutex> lock(mutex);
+        served[seq] = std::make_pair(bytes, std::chrono::steady_clock::now());
+    }
+
+    void Release(int64_t seq) {
+        std::unique_lock<tl::mutex> lock(mutex);
+        auto it = served.find(seq);
+        if (it != served.end()) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - it->second.second;
+            sizer.Record(it->second.first, elapsed.count());
+            served.erase(it);
+        }
+        ring->Release(seq);
+    }
+
+    tl::mutex mutex;
+    std::map<int64_t, std::pair<int32_t, std::chrono::steady_clock::time_point>> served;
+};
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cout << "./ts [selectivity] [backend] [ring_size] [num_handlers] [num_rings] [inline_threshold] [compression] [format] [lease_seconds] [engine] [cpu_threads]" << std::endl;
+        std::cout << "  compression is none or an arrow codec name (lz4, zstd), used while the link is the bottleneck" << std::endl;
+        std::cout << "  format is packed or ipc (Arrow IPC stream messages, compression then applies to every body)" << std::endl;
+        std::cout << "  scans of clients silent for lease_seconds are cancelled" << std::endl;
+        std::cout << "  engine is progress=0|1,spin=0|1,handlers=N or a margo .json file" << std::endl;
+        std::cout << "  cpu_threads sizes the pool that decodes the fragments of threaded scans" << std::endl;
+        exit(1);
+    }
+
+    std::string selectivity = argv[1];
+    std::string backend = argv[2];
+    int32_t ring_size = 4;
+    if (argc > 3) {
+        ring_size = std::stoi(argv[3]);
+    }
+    int32_t num_handlers = 4;
+    if (argc > 4) {
+        num_handlers = std::stoi(argv[4]);
+    }
+    // upper bound on concurrently running scans, further ones wait for a ring
+    int32_t num_rings = 4;
+    if (argc > 5) {
+        num_rings = std::stoi(argv[5]);
+    }
+    int32_t inline_threshold = kInlineThreshold;
+    if (argc > 6) {
+        inline_threshold = std::stoi(argv[6]);
+    }
+    std::string compression = "none";
+    if (argc > 7) {
+        compression = argv[7];
+    }
+    TransferFormat format = kPackedFormat;
+    if (argc > 8) {
+        if (std::string(argv[8]) == "ipc") {
+            format = kIpcFormat;
+        } else if (std::string(argv[8]) != "packed") {
+            std::cerr << "Error: unknown format " << argv[8] << "\n";
+            return -1;
+        }
+    }
+    int32_t lease_seconds = kLeaseSeconds;
+    if (argc > 9) {
+        lease_seconds = std::stoi(argv[9]);
+    }
+    EngineConfig engine_config;
+    if (argc > 10) {
+        arrow::Result<EngineConfig> parsed = ParseEngineConfig(argv[10]);
+        if (!parsed.ok()) {
+            std::cerr << "Error: " << parsed.status().ToString() << "\n";
+            return -1;
+        }
+        engine_config = *parsed;
+    }
+    // scans asking for use_threads decode on Arrow's CPU pool, threads of
+    // its own next to the handler and producer xstreams
+    if (argc > 11) {
+        arrow::Status st = arrow::SetCpuThreadPoolCapacity(std::stoi(argv[11]));
+        if (!st.ok()) {
+            std::cerr << "Error: " << st.ToString() << "\n";
+            return -1;
+        }
+    }
+    if (format == kPackedFormat && !MakeCompressionController(compression).ok()) {
+        std::cerr << "Error: unknown compression " << compression << "\n";
+        return -1;
+    }
+    if (format == kIpcFormat && !MakeIpcWriteOptions(compression).ok()) {
+        std::cerr << "Error: " << MakeIpcWriteOptions(compression).status().ToString() << "\n";
+        return -1;
+    }
+
+    tl::engine engine = MakeEngine("ofi+verbs", THALLIUM_SERVER_MODE, engine_config);
+    margo_instance_id mid = engine.get_margo_instance();
+    hg_addr_t svr_addr;
+    hg_return_t hret = margo_addr_self(mid, &svr_addr);
+    if (hret != HG_SUCCESS) {
+        std::cerr << "Error: margo_addr_lookup()\n";
+        margo_finalize(mid);
+        return -1;
+    }
+
+    ScanRegistry<ScanState> registry;
+    // discovery, schema and footers of the dataset, shared by every scan
+    DatasetCatalog catalog;
+    RingPool ring_pool(engine, num_rings, ring_size, kTransferSize);
+
+    // handlers and producers get separate pools so that decoding keeps going
+    // while the handler ULTs serve the clients, one producer xstream per ring
+    tl::managed<tl::pool> handler_pool = tl::pool::create(tl::pool::access::mpmc);
+    std::vector<tl::managed<tl::xstream>> handler_xstreams;
+    for (int32_t i = 0; i < num_handlers; i++) {
+        handler_xstreams.push_back(tl::xstream::create(tl::scheduler::predef::deflt, *handler_pool));
+    }
+    tl::managed<tl::pool> scan_pool = tl::pool::create(tl::pool::access::mpmc);
+    std::vector<tl::managed<tl::xstream>> scan_xstreams;
+    for (int32_t i = 0; i < num_rings; i++) {
+        scan_xstreams.push_back(tl::xstream::create(tl::scheduler::predef::deflt, *scan_pool));
+    }
+
+    // starts the producer ULT that fills the ring of a new scan
+    std::function<void(std::shared_ptr<ScanState>)> produce =
+        [&compression, format, &scan_pool](std::shared_ptr<ScanState> state) {
+            if (format == kIpcFormat) {
+                arrow::ipc::IpcWriteOptions options = MakeIpcWriteOptions(compression).ValueOrDie();
+                scan_pool->make_thread([state, options]() {
+                    ProduceIpcTransfers(*state->ring, state->reader, state->sizer, options);
+                }, tl::anonymous());
+                return;
+            }
+            // the controller learns from this scan's own speeds
+            std::shared_ptr<CompressionController> controller = MakeCompressionController(compression).ValueOrDie();
+            scan_pool->make_thread([state, controller]() {
+                ProduceTransfers(*state->ring, state->reader, state->sizer, controller);
+            }, tl::anonymous());
+        };
+
+    std::function<void(const tl::request&, const ScanReqRPCStub&)> scan =
+        [&registry, &catalog, &ring_pool, &backend, &selectivity, &produce, lease_seconds](const tl::request &req, const ScanReqRPCStub& stub) {
+            arrow::dataset::internal::Initialize();
+            cp::ExecContext exec_ctx;
+            ScanStats stats;
+            PlanRespStub resp;
+            // filter and schemas come from the client, a bad request only fails its own scan
+            arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> reader =
+                ScanDataset(exec_ctx, stub, backend, selectivity, &stats, &catalog);
+            if (!reader.ok()) {
+                resp.error = reader.status().ToString();
+                return req.respond(resp);
+            }
+
+            std::shared_ptr<ScanState> state = std::make_shared<ScanState>(*reader, &ring_pool);
+            state->stats = stats;
+            produce(state);
+            resp.uuid = registry.Add(state);
+            resp.lease_seconds = lease_seconds;
+            return req.respond(resp);
+        };
+
+    // a scan whose request carries aggregates, answered with the schema of
+    // the aggregated output; the client gets one row per group instead of
+    // every matching row
+    std::function<void(const tl::request&, const ScanReqRPCStub&)> scan_aggregate =
+        [&registry, &catalog, &ring_pool, &selectivity, &produce, lease_seconds](const tl::request &req, const ScanReqRPCStub& stub) {
+            arrow::dataset::internal::Initialize();
+            PlanRespStub resp;
+            ScanStats stats;
+            arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> reader = [&]() -> arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> {
+                ARROW_ASSIGN_OR_RAISE(ScanSpec spec, DecodeScanSpec(stub, selectivity));
+                ARROW_ASSIGN_OR_RAISE(auto dataset, OpenDataset(spec, &stats, &catalog));
+                return AggregateDataset(dataset, spec.filter, stub.aggregates, stub.group_by);
+            }();
+            if (!reader.ok()) {
+                resp.error = reader.status().ToString();
+                return req.respond(resp);
+            }
+            arrow::Result<std::shared_ptr<arrow::Buffer>> schema = arrow::ipc::SerializeSchema(*(*reader)->schema());
+            if (!schema.ok()) {
+                resp.error = schema.status().ToString();
+                return req.respond(resp);
+            }
+            resp.schema = (*schema)->ToString();
+
+            std::shared_ptr<ScanState> state = std::make_shared<ScanState>(*reader, &ring_pool);
+            state->stats = stats;
+            produce(state);
+            resp.uuid = registry.Add(state);
+            resp.lease_seconds = lease_seconds;
+            return req.respond(resp);
+        };
+
+    // runs a Substrait plan over the dataset at stub.path, its output is
+    // served by get_next_batch like the batches of a scan. An aggregation
+    // sends its few result rows instead of the table it was computed from.
+    std::function<void(const tl::request&, const PlanReqRPCStub&)> scan_plan =
+        [&engine, &registry, &catalog, &ring_pool, &produce, lease_seconds](const tl::request &req, const PlanReqRPCStub& stub) {
+            arrow::dataset::internal::Initialize();
+            PlanRespStub resp;
+            std::shared_ptr<arrow::Buffer> plan = arrow::Buffer::FromString(stub.plan);
+            if (stub.plan.empty() && stub.plan_size > 0) {
+                if (stub.plan_size > kMaxPlanSize) {
+                    resp.error = "Plan of " + std::to_string(stub.plan_size) + " bytes is larger than " +
+                                 std::to_string(kMaxPlanSize);
+                    return req.respond(resp);
+                }
+                arrow::Result<std::unique_ptr<arrow::Buffer>> buffer = arrow::AllocateBuffer(stub.plan_size);
+                if (!buffer.ok()) {
+                    resp.error = buffer.status().ToString();
+                    return req.respond(resp);
+                }
+                std::vector<std::pair<void*, size_t>> segments = {{(*buffer)->mutable_data(), (size_t)stub.plan_size}};
+                tl::bulk local = engine.expose(segments, tl::bulk_mode::write_only);
+                stub.bulk.on(req.get_endpoint()) >> local;
+                plan = std::move(*buffer);
+            }
+
+            arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> reader = ExecutePlan(*plan, stub.path, &catalog);
+            if (!reader.ok()) {
+                resp.error = reader.status().ToString();
+                return req.respond(resp);
+            }
+            arrow::Result<std::shared_ptr<arrow::Buffer>> schema = arrow::ipc::SerializeSchema(*(*reader)->schema());
+            if (!schema.ok()) {
+                resp.error = schema.status().ToString();
+                return req.respond(resp);
+            }
+            resp.schema = (*schema)->ToString();
+
+            std::shared_ptr<ScanState> state = std::make_shared<ScanState>(*reader, &ring_pool);
+            produce(state);
+            resp.uuid = registry.Add(state);
+            resp.lease_seconds = lease_seconds;
+            return req.respond(resp);
+        };
+
+    // `released` are the transfers the client is done pulling since its last
+    // request; a prefetching client keeps several of these calls in flight
+    std::function<void(const tl::request&, const std::string&, const std::vector<int64_t>&)> get_next_batch =
+        [&registry, inline_threshold, format](const tl::request &req, const std::string& uuid, const std::vector<int64_t>& released) {
+            std::shared_ptr<ScanState> state = registry.Get(uuid);
+            if (state == nullptr) {
+                ScanRespStubPacked stub;
+                stub.error = "No scan " + uuid + ", it finished, was cancelled or its lease expired";
+                stub.unknown_scan = true;
+                return req.respond(stub);
+            }
+
+            for (int64_t seq : released) {
+                state->Release(seq);
+            }
+
+            int64_t seq;
+            TransferRing::Slot *slot = state->ring->AcquireReady(&seq);
+            if (slot != nullptr) {
+                PackedTransfer &t = slot->transfer;
+                if (t.total_size <= inline_threshold) {
+                    ScanRespStubPacked stub(t.total_size, tl::bulk());
+                    stub.format = format;
+                    stub.seq = seq;
+                    stub.inline_data.assign((const char*)slot->buffer, t.total_size);
+                    // nothing left to pull, the producer can refill the slot right away
+                    state->ring->Release(seq);
+                    return req.respond(stub);
+                }
+                ScanRespStubPacked stub(t.total_size, slot->bulk);
+                stub.format = format;
+                stub.seq = seq;
+                state->Served(seq, t.total_size);
+                return req.respond(stub);
+            } else {
+                // the producer has left, the scan can go once the client
+                // released every slot it is still pulling from
+                if (state->ring->AllReleased()) {
+                    registry.Remove(uuid);
+                }
+                ScanRespStubPacked stub;
+                stub.stats = state->stats;
+                arrow::Status status = state->ring->status();
+                if (!status.ok()) {
+                    stub.error = status.ToString();
+                }
+                return req.respond(stub);
+            }
+        };
+
+    // forgets what the catalog knows about `uri` and lists it again, for
+    // changes the mtimes don't show before the next file check; answers the
+    // number of files, -1 if the listing failed
+    std::function<void(const tl::request&, const std::string&)> refresh =
+        [&catalog](const tl::request &req, const std::string& uri) {
+            arrow::Result<int64_t> files = catalog.Refresh(uri.empty() ? kDatasetUri : uri);
+            if (!files.ok()) {
+                std::cerr << "Error: " << files.status().ToString() << std::endl;
+                return req.respond((int64_t)-1);
+            }
+            return req.respond(*files);
+        };
+
+    // a client that stops early gives the scan up, the reader and the
+    // ring are freed as soon as no handler is in the middle of it anymore
+    std::function<void(const tl::request&, const std::string&)> cancel_scan =
+        [&registry](const tl::request &req, const std::string& uuid) {
+            std::shared_ptr<ScanState> state = registry.Remove(uuid);
+            if (state != nullptr) {
+                state->ring->Abort();
+            }
+            return req.respond(state != nullptr);
+        };
+
+    // renews the lease of a scan whose client is busy with earlier transfers
+    std::function<void(const tl::request&, const std::string&)> keep_alive =
+        [&registry](const tl::request &req, const std::string& uuid) {
+            registry.Touch(uuid);
+        };
+
+    engine.define("scan", scan, 0, *handler_pool);
+    engine.define("scan_aggregate", scan_aggregate, 0, *handler_pool);
+    engine.define("scan_plan", scan_plan, 0, *handler_pool);
+    engine.define("get_next_batch", get_next_batch, 0, *handler_pool);
+    engine.define("cancel_scan", cancel_scan, 0, *handler_pool);
+    engine.define("refresh", refresh, 0, *handler_pool);
+    engine.define("keep_alive", keep_alive, 0, *handler_pool).disable_response();
+
+    // reaper, cancels the scans of clients that went away without a word
+    handler_pool->make_thread([&engine, &registry, lease_seconds]() {
+        while (true) {
+            tl::thread::sleep(engine, lease_seconds * 1000 / 4);
+            for (auto &state : registry.RemoveExpired(std::chrono::seconds(lease_seconds))) {
+                std::cerr << "Reclaiming a scan after " << lease_seconds << "s without a request" << std::endl;
+                state->ring->Abort();
+            }
+        }
+    }, tl::anonymous());
+    std::ofstream file("/tmp/thallium_uri");
+    file << engine.self();
+    file.close();
+    std::cout << "Server running at address " << engine.self() << std::endl;
+
+    engine.wait_for_finalize();
+}
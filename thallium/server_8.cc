@@ -0,0 +1,196 @@
+#include <iostream>
+#include <unordered_map>
+#include <deque>
+#include <fstream>
+
+#include <thallium.hpp>
+
+#include "arrow_headers.h"
+#include "ace.h"
+#include "transfer.h"
+#include "striped.h"
+
+// streaming version of 5: the client grants receive credits once and the
+// server keeps pushing, so there is no get_next_batch round trip per transfer
+
+namespace tl = thallium;
+namespace cp = arrow::compute;
+
+
+const int32_t kTransferSize = 19 * 1024 * 1024;
+const int32_t kMinTransferSize = 1024 * 1024;
+const size_t kMinStripeSize = 1024 * 1024;
+
+
+// receive regions of a client that are currently free to be pushed into
+class StreamCredits {
+    public:
+        StreamCredits(int32_t num_credits) {
+            for (int32_t i = 0; i < num_credits; i++) {
+                free_regions_.push_back(i);
+            }
+        }
+
+        int32_t Acquire() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            while (free_regions_.empty()) {
+                cv_.wait(lock);
+            }
+            int32_t region = free_regions_.front();
+            free_regions_.pop_front();
+            return region;
+        }
+
+        void Release(int32_t region) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            free_regions_.push_back(region);
+            cv_.notify_one();
+        }
+
+    private:
+        tl::mutex mutex_;
+        tl::condition_variable cv_;
+        std::deque<int32_t> free_regions_;
+};
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cout << "./ts [selectivity] [backend] [ring_size] [stripes] [compression]" << std::endl;
+        std::cout << "  compression is none or an arrow codec name (lz4, zstd), used while the link is the bottleneck" << std::endl;
+        exit(1);
+    }
+
+    std::string selectivity = argv[1];
+    std::string backend = argv[2];
+    int32_t ring_size = 4;
+    if (argc > 3) {
+        ring_size = std::stoi(argv[3]);
+    }
+    int32_t num_stripes = 4;
+    if (argc > 4) {
+        num_stripes = std::stoi(argv[4]);
+    }
+    std::string compression = "none";
+    if (argc > 5) {
+        compression = argv[5];
+    }
+    if (!MakeCompressionController(compression).ok()) {
+        std::cerr << "Error: unknown compression " << compression << "\n";
+        return -1;
+    }
+
+    tl::engine engine("ofi+verbs", THALLIUM_SERVER_MODE, true);
+    margo_instance_id mid = engine.get_margo_instance();
+    hg_addr_t svr_addr;
+    hg_return_t hret = margo_addr_self(mid, &svr_addr);
+    if (hret != HG_SUCCESS) {
+        std::cerr << "Error: margo_addr_lookup()\n";
+        margo_finalize(mid);
+        return -1;
+    }
+
+    tl::remote_procedure push_batch = engine.define("push_batch").disable_response();
+    std::unordered_map<std::string, std::shared_ptr<arrow::RecordBatchReader>> reader_map;
+    std::unordered_map<std::string, std::shared_ptr<StreamCredits>> credit_map;
+    TransferRing ring;
+    ring.Expose(engine, ring_size, kTransferSize);
+    tl::managed<tl::xstream> scan_xstream = tl::xstream::create();
+    TransferSizer sizer(kTransferSize, kMinTransferSize, kTransferSize);
+    StripedRdma striped(num_stripes, kMinStripeSize);
+
+    std::function<void(const tl::request&, const ScanReqRPCStub&)> scan =
+        [&reader_map, &backend, &selectivity](const tl::request &req, const ScanReqRPCStub& stub) {
+            arrow::dataset::internal::Initialize();
+            cp::ExecContext exec_ctx;
+            PlanRespStub resp;
+            arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> reader = ScanDataset(exec_ctx, stub, backend, selectivity);
+            if (!reader.ok()) {
+                resp.error = reader.status().ToString();
+                return req.respond(resp);
+            }
+
+            std::string uuid = boost::uuids::to_string(boost::uuids::random_generator()());
+            reader_map[uuid] = *reader;
+            resp.uuid = uuid;
+            return req.respond(resp);
+        };
+
+    // pushes the whole scan into the client's regions and responds with the
+    // number of transfers once the reader is exhausted
+    std::function<void(const tl::request&, const std::string&, tl::bulk&, int32_t)> stream =
+        [&reader_map, &credit_map, &ring, &scan_xstream, &sizer, &striped, &compression, &push_batch](const tl::request &req, const std::string& uuid, tl::bulk& client_bulk, int32_t num_credits) {
+            auto reader_it = reader_map.find(uuid);
+            if (reader_it == reader_map.end()) {
+                std::cerr << "Error: no scan " << uuid << "\n";
+                push_batch.on(req.get_endpoint())(kStreamError, 0, 0);
+                return req.respond(-1);
+            }
+            std::shared_ptr<arrow::RecordBatchReader> reader = reader_it->second;
+            size_t region_size = num_credits > 0 ? client_bulk.size() / num_credits : 0;
+            if (region_size < kTransferSize) {
+                std::cerr << "Error: client regions are smaller than a transfer\n";
+                reader_map.erase(uuid);
+                credit_map.erase(uuid);
+                push_batch.on(req.get_endpoint())(kStreamError, 0, 0);
+                return req.respond(-1);
+            }
+            std::shared_ptr<StreamCredits> credits = std::make_shared<StreamCredits>(num_credits);
+            credit_map[uuid] = credits;
+
+            ring.Reset();
+            std::shared_ptr<CompressionController> controller = MakeCompressionController(compression).ValueOrDie();
+            scan_xstream->make_thread([reader, &ring, &sizer, controller]() {
+                ProduceTransfers(ring, reader, sizer, controller);
+            }, tl::anonymous());
+
+            tl::endpoint ep = req.get_endpoint();
+            int32_t num_transfers = 0;
+            TransferRing::Slot *slot;
+            while ((slot = ring.AcquireReady()) != nullptr) {
+                PackedTransfer &t = slot->transfer;
+                int32_t region = credits->Acquire();
+                auto push_start = std::chrono::steady_clock::now();
+                striped.Push(slot->bulk, 0, client_bulk, region * region_size, ep, t.total_size);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - push_start;
+                sizer.Record(t.total_size, elapsed.count());
+                // the bytes already live on the client, let the producer reuse the slot
+                ring.ReleaseConsumed();
+
+                // the layout travels in the region itself, see PackBatches
+                push_batch.on(ep)(region, num_transfers, t.total_size);
+                num_transfers++;
+            }
+
+            reader_map.erase(uuid);
+            credit_map.erase(uuid);
+            arrow::Status status = ring.status();
+            if (!status.ok()) {
+                std::cerr << "Error: " << status.ToString() << "\n";
+                push_batch.on(ep)(kStreamError, 0, 0);
+                return req.respond(-1);
+            }
+
+            // end of stream carries the number of transfers in place of the sequence number,
+            // the one-way notifications are not ordered so the client counts them
+            push_batch.on(ep)(kEndOfStream, num_transfers, 0);
+            return req.respond(num_transfers);
+        };
+
+    std::function<void(const tl::request&, const std::string&, int32_t)> return_credit =
+        [&credit_map](const tl::request &req, const std::string& uuid, int32_t region) {
+            auto it = credit_map.find(uuid);
+            if (it != credit_map.end()) {
+                it->second->Release(region);
+            }
+        };
+
+    engine.define("scan", scan);
+    engine.define("stream", stream);
+    engine.define("return_credit", return_credit).disable_response();
+    std::ofstream file("/tmp/thallium_uri");
+    file << engine.self();
+    file.close();
+    std::cout << "Server running at address " << engine.self() << std::endl;
+
+    engine.wait_for_finalize();
+}
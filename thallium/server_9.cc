@@ -0,0 +1,263 @@
+#include <iostream>
+#include <unordered_map>
+#include <fstream>
+
+#include <thallium.hpp>
+
+#include <arrow/util/bitmap_ops.h>
+
+#include "arrow_headers.h"
+#include "ace.h"
+#include "transfer.h"
+#include "rdma_pool.h"
+#include "reg_cache.h"
+
+// zero-copy version of 4, the client pulls the column buffers from where
+// the scanner put them, either exposed slabs or per transfer registrations
+
+namespace tl = thallium;
+namespace cp = arrow::compute;
+
+
+const int32_t kTransferSize = 19 * 1024 * 1024;
+const int64_t kSlabSize = 64 * 1024 * 1024;
+
+
+// The buffers of a column the client pulls, covering just its rows so it
+// can read them from offset 0 whatever slice of a larger array the scanner
+// produced. Values are sliced in place; the offsets of a sliced binary
+// column are rebased into a new buffer and booleans that don't start on a
+// byte are copied, both small next to the values.
+struct ExposedColumn {
+    std::shared_ptr<arrow::Buffer> data;
+    // binary columns only
+    std::shared_ptr<arrow::Buffer> offsets;
+};
+
+arrow::Result<ExposedColumn> ExposeColumn(const std::shared_ptr<arrow::Array>& col_arr, arrow::MemoryPool *pool) {
+    ExposedColumn col;
+    int64_t offset = col_arr->offset();
+    int64_t length = col_arr->length();
+    if (is_binary_like(col_arr->type_id())) {
+        auto binary = std::static_pointer_cast<arrow::BinaryArray>(col_arr);
+        int32_t first = binary->value_offset(0);
+        int32_t last = binary->value_offset(length);
+        col.data = arrow::SliceBuffer(binary->value_data(), first, last - first);
+        int64_t offsets_size = (length + 1) * sizeof(int32_t);
+        if (first == 0) {
+            col.offsets = arrow::SliceBuffer(binary->value_offsets(), offset * sizeof(int32_t), offsets_size);
+        } else {
+            ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> rebased, arrow::AllocateBuffer(offsets_size, pool));
+            int32_t *out = (int32_t*)rebased->mutable_data();
+            for (int64_t i = 0; i <= length; i++) {
+                out[i] = binary->value_offset(i) - first;
+            }
+            col.offsets = std::move(rebased);
+        }
+        return col;
+    }
+
+    const std::shared_ptr<arrow::Buffer> &values = col_arr->data()->buffers[1];
+    int bit_width = std::static_pointer_cast<arrow::FixedWidthType>(col_arr->type())->bit_width();
+    if (bit_width % 8 == 0) {
+        col.data = arrow::SliceBuffer(values, offset * bit_width / 8, length * bit_width / 8);
+    } else if (offset % 8 == 0) {
+        col.data = arrow::SliceBuffer(values, offset / 8, (length + 7) / 8);
+    } else {
+        ARROW_ASSIGN_OR_RAISE(col.data, arrow::internal::CopyBitmap(pool, values->data(), offset, length));
+    }
+    return col;
+}
+
+// what get_next_batch exposes of `batch`, see ExposeColumn; validity is not sent
+int64_t ExposedBatchSize(const std::shared_ptr<arrow::RecordBatch>& batch) {
+    int64_t size = 0;
+    for (auto &col_arr : batch->columns()) {
+        int64_t length = col_arr->length();
+        if (is_binary_like(col_arr->type_id())) {
+            auto binary = std::static_pointer_cast<arrow::BinaryArray>(col_arr);
+            size += (length + 1) * sizeof(int32_t) + binary->value_offset(length) - binary->value_offset(0);
+        } else {
+            int bit_width = std::static_pointer_cast<arrow::FixedWidthType>(col_arr->type())->bit_width();
+            size += bit_width % 8 == 0 ? length * bit_width / 8 : (length + 7) / 8;
+        }
+    }
+    return size;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cout << "./ts [selectivity] [backend] [num_slabs]" << std::endl;
+        std::cout << "  num_slabs 0 decodes into the default pool and registers each allocation once, until it is freed" << std::endl;
+        exit(1);
+    }
+
+    std::string selectivity = argv[1];
+    std::string backend = argv[2];
+    int32_t num_slabs = 16;
+    if (argc > 3) {
+        num_slabs = std::stoi(argv[3]);
+    }
+
+    tl::engine engine("ofi+verbs", THALLIUM_SERVER_MODE, true);
+    margo_instance_id mid = engine.get_margo_instance();
+    hg_addr_t svr_addr;
+    hg_return_t hret = margo_addr_self(mid, &svr_addr);
+    if (hret != HG_SUCCESS) {
+        std::cerr << "Error: margo_addr_lookup()\n";
+        margo_finalize(mid);
+        return -1;
+    }
+
+    RdmaMemoryPool rdma_pool(engine, num_slabs, kSlabSize);
+
+    // the slabs stay exposed, allocations the pool falls back for are exposed
+    // once and dropped when freed, anything else goes with its transfer
+    RegistrationCache reg_cache(engine, &rdma_pool);
+    for (int32_t i = 0; i < rdma_pool.num_slabs(); i++) {
+        reg_cache.Pin(rdma_pool.SlabData(i), rdma_pool.SlabSize(), rdma_pool.SlabBulk(i));
+    }
+
+    std::unordered_map<std::string, std::shared_ptr<TransferSource>> source_map;
+    // batches the client is still pulling from and the registrations they
+    // use, kept alive until its next request
+    struct Inflight {
+        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        std::vector<std::shared_ptr<RegistrationCache::Ref>> refs;
+        // rebased offsets and copied bitmaps of sliced columns
+        std::vector<std::shared_ptr<arrow::Buffer>> buffers;
+    };
+    std::unordered_map<std::string, Inflight> inflight_map;
+
+    std::function<void(const tl::request&, const ScanReqRPCStub&)> scan =
+        [&source_map, &backend, &selectivity, &rdma_pool](const tl::request &req, const ScanReqRPCStub& stub) {
+            arrow::dataset::internal::Initialize();
+            cp::ExecContext exec_ctx(&rdma_pool);
+            PlanRespStub resp;
+            arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> reader = ScanDataset(exec_ctx, stub, backend, selectivity);
+            if (!reader.ok()) {
+                resp.error = reader.status().ToString();
+                return req.respond(resp);
+            }
+
+            std::string uuid = boost::uuids::to_string(boost::uuids::random_generator()());
+            source_map[uuid] = std::make_shared<TransferSource>(*reader, ExposedBatchSize);
+            resp.uuid = uuid;
+            return req.respond(resp);
+        };
+
+    std::function<void(const tl::request&, const std::string&)> get_next_batch =
+        [&source_map, &inflight_map, &reg_cache, &rdma_pool](const tl::request &req, const std::string& uuid) {
+            inflight_map.erase(uuid);
+            auto source_it = source_map.find(uuid);
+            if (source_it == source_map.end()) {
+                ScanRespStubSeg stub;
+                stub.error = "No scan " + uuid;
+                return req.respond(stub);
+            }
+            std::shared_ptr<TransferSource> source = source_it->second;
+
+            // buffers go out whole, so batches can't be split to fit the client's region
+            arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> next =
+                source->Next(kTransferSize, kTransferSize, false);
+            if (!next.ok()) {
+                source_map.erase(uuid);
+                ScanRespStubSeg stub;
+                stub.error = next.status().ToString();
+                return req.respond(stub);
+            }
+            std::vector<std::shared_ptr<arrow::RecordBatch>> batches = std::move(*next);
+            if (batches.size() == 0) {
+                source_map.erase(uuid);
+                std::cout << "Buffers so far: " << reg_cache.hits() << " already exposed, "
+                          << reg_cache.misses() << " registered" << std::endl;
+                ScanRespStubSeg stub;
+                return req.respond(stub);
+            }
+
+            ScanRespStubSeg stub;
+            Inflight inflight;
+            // cache entry -> index into stub.bulks
+            std::unordered_map<const RegistrationCache::Entry*, int32_t> bulk_ids;
+
+            // describes one buffer, returns its position in the client's region
+            auto add_buffer = [&](const std::shared_ptr<arrow::Buffer>& buff) {
+                int32_t pos = stub.total_size;
+                int32_t size = buff->size();
+                if (size == 0) {
+                    return pos;
+                }
+
+                std::shared_ptr<RegistrationCache::Ref> ref = reg_cache.Acquire(buff->data(), size);
+                int64_t offset = ref->offset();
+
+                int32_t id;
+                auto it = bulk_ids.find(ref->entry());
+                if (it == bulk_ids.end()) {
+                    id = stub.bulks.size();
+                    bulk_ids[ref->entry()] = id;
+                    stub.bulks.push_back(ref->bulk());
+                } else {
+                    id = it->second;
+                }
+                inflight.refs.push_back(ref);
+
+                // buffers allocated back to back in a slab become one pull
+                if (!stub.extent_sizes.empty() && stub.extent_bulks.back() == id &&
+                    stub.extent_offsets.back() + stub.extent_sizes.back() == offset) {
+                    stub.extent_sizes.back() += size;
+                } else {
+                    stub.extent_bulks.push_back(id);
+                    stub.extent_offsets.push_back(offset);
+                    stub.extent_sizes.push_back(size);
+                }
+                stub.total_size += size;
+                return pos;
+            };
+
+            for (auto b : batches) {
+                stub.batch_sizes.push_back(b->num_rows());
+                for (int32_t i = 0; i < b->num_columns(); i++) {
+                    arrow::Result<ExposedColumn> col = ExposeColumn(b->column(i), &rdma_pool);
+                    if (!col.ok()) {
+                        source_map.erase(uuid);
+                        ScanRespStubSeg error;
+                        error.error = col.status().ToString();
+                        return req.respond(error);
+                    }
+                    stub.data_offsets.push_back(add_buffer(col->data));
+                    stub.data_sizes.push_back(col->data->size());
+                    inflight.buffers.push_back(col->data);
+                    if (col->offsets != nullptr) {
+                        stub.off_offsets.push_back(add_buffer(col->offsets));
+                        stub.off_sizes.push_back(col->offsets->size());
+                        inflight.buffers.push_back(col->offsets);
+                    } else {
+                        stub.off_offsets.push_back(stub.total_size);
+                        stub.off_sizes.push_back(0);
+                    }
+                }
+            }
+
+            // the source measured the same buffers, this only guards the client's region
+            if (stub.total_size > kTransferSize) {
+                source_map.erase(uuid);
+                ScanRespStubSeg error;
+                error.error = "Transfer of " + std::to_string(stub.total_size) + " bytes exceeds the client region";
+                return req.respond(error);
+            }
+
+            inflight.batches = batches;
+            inflight_map[uuid] = std::move(inflight);
+            return req.respond(stub);
+        };
+
+    engine.define("scan", scan);
+    engine.define("get_next_batch", get_next_batch);
+    std::ofstream file("/tmp/thallium_uri");
+    file << engine.self();
+    file.close();
+    std::cout << "Server running at address " << engine.self() << std::endl;
+
+    engine.wait_for_finalize();
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <thallium.hpp>
+
+#include "recv_pool.h"
+#include "striped.h"
+#include "engine_config.h"
+
+
+namespace tl = thallium;
+
+
+// Everything a client keeps for its whole life instead of per scan or per
+// transfer: the engine, one endpoint per server address, the RPC handles
+// (each name is registered with Mercury once, in the constructor) and the
+// receive regions, exposed once and leased by every scan in turn. The
+// control path of a transfer is then a single RPC with no registration.
+// A heartbeat ULT renews the server side lease of every open scan, so one
+// the application is slow to consume is not taken for abandoned.
+class ThalliumSession {
+    public:
+        ThalliumSession(const std::string& protocol, int32_t num_regions, size_t region_size,
+                        int32_t num_stripes, size_t min_stripe_size, int32_t depth,
+                        const EngineConfig& engine_config = EngineConfig())
+            : engine_(MakeEngine(protocol, THALLIUM_SERVER_MODE, engine_config)),
+              scan_(engine_.define("scan")),
+              scan_aggregate_(engine_.define("scan_aggregate")),
+              scan_plan_(engine_.define("scan_plan")),
+              get_next_batch_(engine_.define("get_next_batch")),
+              cancel_scan_(engine_.define("cancel_scan")),
+              refresh_(engine_.define("refresh")),
+              keep_alive_(engine_.define("keep_alive").disable_response()),
+              depth_(depth) {
+            pool_ = std::make_shared<ReceivePool>(engine_, num_regions, region_size);
+            striped_ = std::make_shared<StripedRdma>(num_stripes, min_stripe_size);
+            heartbeat_xstream_ = tl::xstream::create();
+            heartbeat_ = heartbeat_xstream_->make_thread([this]() {
+                Heartbeat();
+            });
+        }
+
+        // the endpoint of `uri`, looked up on first use only
+        tl::endpoint Lookup(const std::string& uri) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            auto it = endpoints_.find(uri);
+            if (it == endpoints_.end()) {
+                it = endpoints_.emplace(uri, engine_.lookup(uri)).first;
+            }
+            return it->second;
+        }
+
+        tl::engine& engine() { return engine_; }
+        const tl::remote_procedure& scan() const { return scan_; }
+        const tl::remote_procedure& scan_aggregate() const { return scan_aggregate_; }
+        const tl::remote_procedure& scan_plan() const { return scan_plan_; }
+        const tl::remote_procedure& get_next_batch() const { return get_next_batch_; }
+        const tl::remote_procedure& cancel_scan() const { return cancel_scan_; }
+        const tl::remote_procedure& refresh() const { return refresh_; }
+        std::shared_ptr<ReceivePool> pool() const { return pool_; }
+        std::shared_ptr<StripedRdma> striped() const { return striped_; }
+        // get_next_batch calls each scan keeps in flight
+        int32_t depth() const { return depth_; }
+
+        // scans whose leases the heartbeat renews, a few times per
+        // `lease_seconds` of the server; a lease of 0 never runs out
+        void OpenScan(const std::string& uuid, const tl::endpoint& endpoint, int32_t lease_seconds) {
+            if (lease_seconds <= 0) {
+                return;
+            }
+            std::unique_lock<tl::mutex> lock(mutex_);
+            OpenScanEntry &entry = open_scans_[uuid];
+            entry.endpoint = endpoint;
+            entry.interval_ms = std::max(kPollMs, lease_seconds * 1000 / kHeartbeatsPerLease);
+            entry.waited_ms = 0;
+        }
+
+        void CloseScan(const std::string& uuid) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            open_scans_.erase(uuid);
+        }
+
+        // drops the regions and endpoints before the engine goes away, every
+        // scan and batch of the session must be gone by then
+        void Finalize() {
+            {
+                std::unique_lock<tl::mutex> lock(mutex_);
+                stopped_ = true;
+            }
+            heartbeat_->join();
+            heartbeat_xstream_->join();
+            open_scans_.clear();
+            endpoints_.clear();
+            striped_.reset();
+            pool_.reset();
+            engine_.finalize();
+        }
+
+    private:
+        // a lost or late keep_alive still leaves the lease a margin
+        static const int32_t kHeartbeatsPerLease = 4;
+        static const int32_t kPollMs = 100;
+
+        struct OpenScanEntry {
+            tl::endpoint endpoint;
+            int32_t interval_ms = 0;
+            int32_t waited_ms = 0;
+        };
+
+        void Heartbeat() {
+            while (true) {
+                tl::thread::sleep(engine_, kPollMs);
+                std::vector<std::pair<std::string, tl::endpoint>> due;
+                {
+                    std::unique_lock<tl::mutex> lock(mutex_);
+                    if (stopped_) {
+                        return;
+                    }
+                    for (auto &scan : open_scans_) {
+                        scan.second.waited_ms += kPollMs;
+                        if (scan.second.waited_ms >= scan.second.interval_ms) {
+                            scan.second.waited_ms = 0;
+                            due.emplace_back(scan.first, scan.second.endpoint);
+                        }
+                    }
+                }
+                for (auto &scan : due) {
+                    keep_alive_.on(scan.second)(scan.first);
+                }
+            }
+        }
+
+        tl::engine engine_;
+        tl::remote_procedure scan_;
+        tl::remote_procedure scan_aggregate_;
+        tl::remote_procedure scan_plan_;
+        tl::remote_procedure get_next_batch_;
+        tl::remote_procedure cancel_scan_;
+        tl::remote_procedure refresh_;
+        tl::remote_procedure keep_alive_;
+        int32_t depth_;
+        std::shared_ptr<ReceivePool> pool_;
+        std::shared_ptr<StripedRdma> striped_;
+
+        tl::mutex mutex_;
+        std::unordered_map<std::string, tl::endpoint> endpoints_;
+        std::unordered_map<std::string, OpenScanEntry> open_scans_;
+        bool stopped_ = false;
+
+        tl::managed<tl::xstream> heartbeat_xstream_;
+        tl::managed<tl::thread> heartbeat_;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <thallium.hpp>
+
+
+namespace tl = thallium;
+
+
+// Issues a large transfer as several concurrent bulk operations, one byte
+// stripe per ULT, on a private pool served by its own xstreams. A single
+// serialized bulk op leaves most queues of a multi-queue NIC (and most
+// connections of ofi+tcp) idle.
+class StripedRdma {
+    public:
+        StripedRdma(int32_t num_stripes, size_t min_stripe_size)
+            : num_stripes_(num_stripes), min_stripe_size_(min_stripe_size),
+              pool_(tl::pool::create(tl::pool::access::mpmc)) {
+            for (int32_t i = 0; i < num_stripes_; i++) {
+                xstreams_.push_back(tl::xstream::create(tl::scheduler::predef::deflt, *pool_));
+            }
+        }
+
+        // remote(remote_offset, size) >> local(local_offset, size)
+        void Pull(const tl::bulk& remote, size_t remote_offset, const tl::endpoint& ep,
+                  const tl::bulk& local, size_t local_offset, size_t size) {
+            ForEachStripe(size, [&](size_t off, size_t len) {
+                remote(remote_offset + off, len).on(ep) >> local(local_offset + off, len);
+            });
+        }
+
+        // local(local_offset, size) >> remote(remote_offset, size)
+        void Push(const tl::bulk& local, size_t local_offset,
+                  const tl::bulk& remote, size_t remote_offset, const tl::endpoint& ep, size_t size) {
+            ForEachStripe(size, [&](size_t off, size_t len) {
+                local(local_offset + off, len) >> remote(remote_offset + off, len).on(ep);
+            });
+        }
+
+    private:
+        template <typename F>
+        void ForEachStripe(size_t size, F&& op) {
+            size_t stripes = std::min((size_t)num_stripes_, size / min_stripe_size_);
+            if (stripes <= 1) {
+                op(0, size);
+                return;
+            }
+            size_t stripe_size = (size + stripes - 1) / stripes;
+            std::vector<tl::managed<tl::thread>> threads;
+            for (size_t off = 0; off < size; off += stripe_size) {
+                size_t len = std::min(stripe_size, size - off);
+                threads.push_back(pool_->make_thread([&op, off, len]() {
+                    op(off, len);
+                }));
+            }
+            for (auto &t : threads) {
+                t->join();
+            }
+        }
+
+        int32_t num_stripes_;
+        size_t min_stripe_size_;
+        tl::managed<tl::pool> pool_;
+        std::vector<tl::managed<tl::xstream>> xstreams_;
+};
@@ -0,0 +1,1170 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <thallium.hpp>
+
+#include <arrow/util/bit_util.h>
+#include <arrow/util/bitmap_ops.h>
+#include <arrow/util/compression.h>
+
+#include "arrow_headers.h"
+#include "encoding.h"
+
+
+namespace tl = thallium;
+
+
+// where one buffer landed in a transfer
+struct BufferSpan {
+    int32_t offset = 0;
+    // bytes on the wire
+    int32_t size = 0;
+    // size once decompressed, 0 when the buffer is sent as is
+    int32_t raw_size = 0;
+};
+
+// the buffers of one column of one batch inside a transfer
+struct ColumnLayout {
+    int32_t null_count = 0;
+    // size 0 when the column has no nulls
+    BufferSpan validity;
+    // fixed width values, bit-packed booleans or dictionary indices
+    BufferSpan data;
+    // integer columns only: how data is encoded, see encoding.h
+    bool has_encoding = false;
+    int32_t encoding = kPlain;
+    // 32 or 64 bit value offsets of (large) binary columns
+    BufferSpan offsets;
+    // dictionary columns only: a dictionary replacing the previous one of the
+    // column, dict_length is 0 while it does not change
+    bool has_dictionary = false;
+    int32_t dict_length = 0;
+    int32_t dict_null_count = 0;
+    BufferSpan dict_validity;
+    BufferSpan dict_data;
+    BufferSpan dict_offsets;
+};
+
+// calls `f` on every buffer of `c` in the order they are laid out
+template <typename Column, typename F>
+void ForEachBuffer(Column& c, F f) {
+    f(c.validity);
+    f(c.data);
+    f(c.offsets);
+    if (c.has_dictionary) {
+        f(c.dict_validity);
+        f(c.dict_data);
+        f(c.dict_offsets);
+    }
+}
+
+struct PackedTransfer {
+    // TypeTags of every column, see WriteLayout
+    std::vector<int32_t> type_tags;
+    std::vector<int32_t> batch_sizes;
+    // batch major, one entry per column of every batch
+    std::vector<ColumnLayout> columns;
+    // codec of the compressed buffers
+    arrow::Compression::type codec = arrow::Compression::UNCOMPRESSED;
+    int32_t total_size = 0;
+};
+
+// the bytes of one column of a (possibly sliced) batch as they go on the wire
+struct ColumnSpan {
+    int64_t length = 0;
+    int64_t null_count = 0;
+    // bitmaps are cut from this bit on
+    int64_t bit_offset = 0;
+    // nullptr when there are no nulls
+    const uint8_t *validity = nullptr;
+    // values, or a bitmap for booleans
+    const uint8_t *data = nullptr;
+    int64_t data_size = 0;
+    bool bit_packed = false;
+    // value offsets of (large) binary columns, offset_width 0 for fixed width ones
+    const uint8_t *offsets = nullptr;
+    int32_t offset_width = 0;
+    // the values of a dictionary column, the span itself covers the indices
+    std::shared_ptr<arrow::Array> dictionary;
+};
+
+// whether columns of `type` can go on the wire
+bool IsWireType(const std::shared_ptr<arrow::DataType>& type) {
+    if (type->id() == arrow::Type::DICTIONARY) {
+        return IsWireType(static_cast<const arrow::DictionaryType&>(*type).value_type());
+    }
+    return is_binary_like(type->id()) || is_large_binary_like(type->id()) ||
+           (arrow::is_fixed_width(type->id()) && type->id() != arrow::Type::NA);
+}
+
+ColumnSpan GetColumnSpan(const std::shared_ptr<arrow::Array>& col_arr) {
+    if (col_arr->type_id() == arrow::Type::DICTIONARY) {
+        auto dict_arr = std::static_pointer_cast<arrow::DictionaryArray>(col_arr);
+        ColumnSpan span = GetColumnSpan(dict_arr->indices());
+        span.dictionary = dict_arr->dictionary();
+        return span;
+    }
+
+    ColumnSpan span;
+    const arrow::ArrayData &data = *col_arr->data();
+    span.length = data.length;
+    span.null_count = col_arr->null_count();
+    span.bit_offset = data.offset;
+    if (span.null_count > 0) {
+        span.validity = data.buffers[0]->data();
+    }
+
+    if (is_binary_like(col_arr->type_id()) || is_large_binary_like(col_arr->type_id())) {
+        span.offset_width = is_binary_like(col_arr->type_id()) ? sizeof(int32_t) : sizeof(int64_t);
+        if (data.buffers[1] == nullptr) {
+            return span;
+        }
+        int64_t first, last;
+        if (span.offset_width == sizeof(int32_t)) {
+            const int32_t *offsets = data.GetValues<int32_t>(1);
+            first = offsets[0];
+            last = offsets[span.length];
+            span.offsets = (const uint8_t*)offsets;
+        } else {
+            const int64_t *offsets = data.GetValues<int64_t>(1);
+            first = offsets[0];
+            last = offsets[span.length];
+            span.offsets = (const uint8_t*)offsets;
+        }
+        if (data.buffers[2] != nullptr) {
+            span.data = data.buffers[2]->data() + first;
+            span.data_size = last - first;
+        }
+    } else if (data.buffers[1] != nullptr) {
+        int bit_width = static_cast<const arrow::FixedWidthType&>(*col_arr->type()).bit_width();
+        if (bit_width == 1) {
+            span.bit_packed = true;
+            span.data = data.buffers[1]->data();
+            span.data_size = arrow::bit_util::BytesForBits(span.length);
+        } else {
+            span.data = data.buffers[1]->data() + data.offset * (bit_width / 8);
+            span.data_size = span.length * (bit_width / 8);
+        }
+    }
+    return span;
+}
+
+// every buffer starts 8-byte aligned in the segment
+int64_t PaddedSize(int64_t size) {
+    return (size + 7) & ~7;
+}
+
+int64_t ValiditySize(const ColumnSpan& span) {
+    return span.validity != nullptr ? arrow::bit_util::BytesForBits(span.length) : 0;
+}
+
+int64_t OffsetsSize(const ColumnSpan& span) {
+    return span.offset_width > 0 ? (span.length + 1) * span.offset_width : 0;
+}
+
+int64_t SpanWireSize(const ColumnSpan& span) {
+    return PaddedSize(ValiditySize(span)) + PaddedSize(span.data_size) + PaddedSize(OffsetsSize(span));
+}
+
+// Every packed transfer starts with a layout header so that the control
+// RPC only has to carry the total size:
+//
+//   u32 length of the rest of the header
+//   u8  version, u8 codec (arrow::Compression::type)
+//   varint num_batches, varint num_columns
+//   per column its TypeTags, each a varint
+//   per batch: varint num_rows, then per column
+//     varint null_count, buffer validity, buffer data, buffer offsets
+//     and for integer columns varint encoding (see encoding.h)
+//     and for dictionary columns varint dict_length, varint dict_null_count,
+//       buffer dict_validity, buffer dict_data, buffer dict_offsets
+//
+// where a buffer is its varint size, followed by its varint decompressed
+// size (0 if it is not compressed) when the codec is not UNCOMPRESSED.
+//
+// The buffers of a column follow in that order from the next 8-byte boundary,
+// back to back and padded, so their offsets are implied by the sizes and are
+// not sent. Bitmaps always start at bit 0, binary offsets at 0. A dictionary
+// is only sent when it differs from the last one sent for its column.
+//
+// Column types are not sent, the client decodes with the schema it expects;
+// the type tags make it fail on a column the server produced differently
+// instead of misreading the header.
+const uint8_t kLayoutVersion = 6;
+
+// worst case of the fixed part of the header including its padding
+const int64_t kLayoutPrefixBound = 32;
+
+// the ids a column's type is checked by: its own, the bit width of fixed
+// width types, and the tags of a dictionary's indices and values
+std::vector<int32_t> TypeTags(const std::shared_ptr<arrow::DataType>& type) {
+    std::vector<int32_t> tags = {(int32_t)type->id()};
+    if (type->id() == arrow::Type::DICTIONARY) {
+        const arrow::DictionaryType &dict_type = static_cast<const arrow::DictionaryType&>(*type);
+        for (auto &nested : {dict_type.index_type(), dict_type.value_type()}) {
+            std::vector<int32_t> nested_tags = TypeTags(nested);
+            tags.insert(tags.end(), nested_tags.begin(), nested_tags.end());
+        }
+    } else if (arrow::is_fixed_width(type->id())) {
+        tags.push_back(static_cast<const arrow::FixedWidthType&>(*type).bit_width());
+    }
+    return tags;
+}
+
+// worst case of the type tags of `num_columns` columns, a dictionary has
+// five tags and no varint of them takes more than 5 bytes
+int64_t LayoutTypesBound(int32_t num_columns) {
+    return num_columns * 5 * 5;
+}
+
+// worst case of one batch entry, every varint holds at most 32 bits
+int64_t LayoutBatchBound(int32_t num_columns) {
+    return 5 + num_columns * 16 * 5;
+}
+
+void PutVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+arrow::Result<int32_t> GetVarint(const uint8_t **pos, const uint8_t *end) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*pos == end) {
+            return arrow::Status::Invalid("Truncated transfer layout");
+        }
+        uint8_t byte = *(*pos)++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            if (value > INT32_MAX) {
+                return arrow::Status::Invalid("Transfer layout value out of range");
+            }
+            return (int32_t)value;
+        }
+    }
+    return arrow::Status::Invalid("Transfer layout varint is too long");
+}
+
+// writes the layout header of `t` at the head of `buffer` and places its
+// buffers after it, the sizes of `t` must be final
+void WriteLayout(PackedTransfer& t, uint8_t *buffer) {
+    bool compressed = t.codec != arrow::Compression::UNCOMPRESSED;
+    int32_t num_columns = t.batch_sizes.empty() ? 0 : t.columns.size() / t.batch_sizes.size();
+    std::string layout;
+    layout.push_back((char)kLayoutVersion);
+    layout.push_back((char)t.codec);
+    PutVarint(layout, t.batch_sizes.size());
+    PutVarint(layout, num_columns);
+    for (int32_t tag : t.type_tags) {
+        PutVarint(layout, tag);
+    }
+    for (size_t b = 0; b < t.batch_sizes.size(); b++) {
+        PutVarint(layout, t.batch_sizes[b]);
+        for (int32_t i = 0; i < num_columns; i++) {
+            const ColumnLayout &c = t.columns[b * num_columns + i];
+            PutVarint(layout, c.null_count);
+            auto put_buffer = [&](const BufferSpan& buff) {
+                PutVarint(layout, buff.size);
+                if (compressed) {
+                    PutVarint(layout, buff.raw_size);
+                }
+            };
+            put_buffer(c.validity);
+            put_buffer(c.data);
+            put_buffer(c.offsets);
+            if (c.has_encoding) {
+                PutVarint(layout, c.encoding);
+            }
+            if (c.has_dictionary) {
+                PutVarint(layout, c.dict_length);
+                PutVarint(layout, c.dict_null_count);
+                put_buffer(c.dict_validity);
+                put_buffer(c.dict_data);
+                put_buffer(c.dict_offsets);
+            }
+        }
+    }
+
+    uint32_t layout_size = layout.size();
+    memcpy(buffer, &layout_size, sizeof(layout_size));
+    memcpy(buffer + sizeof(layout_size), layout.data(), layout.size());
+    int32_t curr_pos = PaddedSize(sizeof(layout_size) + layout.size());
+    for (auto &c : t.columns) {
+        ForEachBuffer(c, [&](BufferSpan& buff) {
+            buff.offset = curr_pos;
+            curr_pos += PaddedSize(buff.size);
+        });
+    }
+    t.total_size = curr_pos;
+}
+
+// an upper bound of what PackBatches writes for `batch`, layout entry and
+// dictionaries included
+int64_t PackedBatchSize(const std::shared_ptr<arrow::RecordBatch>& batch) {
+    int64_t size = LayoutBatchBound(batch->num_columns());
+    for (int32_t i = 0; i < batch->num_columns(); i++) {
+        ColumnSpan span = GetColumnSpan(batch->column(i));
+        size += SpanWireSize(span);
+        if (span.dictionary != nullptr) {
+            size += SpanWireSize(GetColumnSpan(span.dictionary));
+        }
+    }
+    return size;
+}
+
+// what the packer of a scan carries from one transfer to the next
+struct PackState {
+    // the dictionary of every column as last sent to the client
+    std::vector<std::shared_ptr<arrow::Array>> dictionaries;
+    // uncompressed transfer and compressed buffers on their way to a slot
+    std::vector<uint8_t> raw;
+    std::vector<uint8_t> compressed;
+};
+
+template <typename T>
+void RebaseOffsets(const uint8_t *src, int64_t num_offsets, uint8_t *dst) {
+    const T *in = (const T*)src;
+    T *out = (T*)dst;
+    for (int64_t j = 0; j < num_offsets; j++) {
+        out[j] = in[j] - in[0];
+    }
+}
+
+// copies the buffers of `span` to where the layout placed them, validity is
+// skipped when nullptr and the values go through `plan` when there is one
+void WriteSpan(const ColumnSpan& span, uint8_t *buffer, const BufferSpan *validity,
+               const BufferSpan& data, const BufferSpan& offsets, const EncodingPlan *plan) {
+    if (validity != nullptr && validity->size > 0) {
+        arrow::internal::CopyBitmap(span.validity, span.bit_offset, span.length, buffer + validity->offset, 0);
+    }
+
+    if (span.bit_packed) {
+        arrow::internal::CopyBitmap(span.data, span.bit_offset, span.length, buffer + data.offset, 0);
+    } else if (plan != nullptr && plan->encoding != kPlain) {
+        DispatchInteger(plan->width, plan->is_signed, [&](auto *tag) {
+            EncodeIntegers((decltype(tag))span.data, span.length, *plan, buffer + data.offset);
+        });
+    } else if (span.data_size > 0) {
+        memcpy(buffer + data.offset, span.data, span.data_size);
+    }
+
+    if (span.offsets == nullptr) {
+        memset(buffer + offsets.offset, 0, offsets.size);
+    } else if (span.offset_width == sizeof(int32_t)) {
+        RebaseOffsets<int32_t>(span.offsets, span.length + 1, buffer + offsets.offset);
+    } else {
+        RebaseOffsets<int64_t>(span.offsets, span.length + 1, buffer + offsets.offset);
+    }
+}
+
+// writes the layout header and then the buffers of every column of every
+// batch into `buffer`, in the same order as the get_next_batch loop in
+// server_3.cc. Sliced columns are cut to their rows, binary offsets are
+// rebased to start at 0, integer values are encoded when that is smaller and
+// dictionaries the client already has are left out. The caller makes sure the
+// batches fit, see TransferSource.
+PackedTransfer PackBatches(const std::vector<std::shared_ptr<arrow::RecordBatch>>& batches, uint8_t *buffer, PackState& state) {
+    PackedTransfer t;
+    int32_t num_columns = batches.empty() ? 0 : batches[0]->num_columns();
+    state.dictionaries.resize(num_columns);
+    for (int32_t i = 0; i < num_columns; i++) {
+        std::vector<int32_t> tags = TypeTags(batches[0]->column(i)->type());
+        t.type_tags.insert(t.type_tags.end(), tags.begin(), tags.end());
+    }
+
+    std::vector<ColumnSpan> spans;
+    std::vector<ColumnSpan> dict_spans;
+    std::vector<EncodingPlan> plans;
+    for (auto b : batches) {
+        t.batch_sizes.push_back(b->num_rows());
+        for (int32_t i = 0; i < num_columns; i++) {
+            ColumnSpan span = GetColumnSpan(b->column(i));
+            ColumnLayout c;
+            c.null_count = span.null_count;
+            c.validity.size = ValiditySize(span);
+            c.data.size = span.data_size;
+            c.offsets.size = OffsetsSize(span);
+
+            // integer values are encoded by what their statistics favour
+            EncodingPlan plan;
+            if (span.dictionary == nullptr) {
+                plan = PlanColumnEncoding(b->column(i)->type(), span.data, span.length);
+            }
+            if (plan.width > 0) {
+                c.has_encoding = true;
+                c.encoding = plan.encoding;
+                c.data.size = plan.size;
+            }
+
+            ColumnSpan dict_span;
+            if (span.dictionary != nullptr) {
+                std::shared_ptr<arrow::Array> &sent = state.dictionaries[i];
+                if (sent == nullptr || (sent != span.dictionary && !sent->Equals(*span.dictionary))) {
+                    dict_span = GetColumnSpan(span.dictionary);
+                    sent = span.dictionary;
+                }
+                c.has_dictionary = true;
+                c.dict_length = dict_span.length;
+                c.dict_null_count = dict_span.null_count;
+                c.dict_validity.size = ValiditySize(dict_span);
+                c.dict_data.size = dict_span.data_size;
+                c.dict_offsets.size = OffsetsSize(dict_span);
+            }
+            t.columns.push_back(c);
+            spans.push_back(span);
+            dict_spans.push_back(dict_span);
+            plans.push_back(plan);
+        }
+    }
+
+    WriteLayout(t, buffer);
+    for (size_t k = 0; k < spans.size(); k++) {
+        const ColumnLayout &c = t.columns[k];
+        WriteSpan(spans[k], buffer, &c.validity, c.data, c.offsets, &plans[k]);
+        if (c.has_dictionary) {
+            WriteSpan(dict_spans[k], buffer, &c.dict_validity, c.dict_data, c.dict_offsets, nullptr);
+        }
+    }
+    return t;
+}
+
+// buffers smaller than this are not worth a codec call
+const int64_t kMinCompressSize = 4096;
+
+// repacks the uncompressed transfer `raw` found at `raw_base` into `buffer`,
+// compressing every buffer that `codec` makes smaller
+PackedTransfer CompressTransfer(const PackedTransfer& raw, const uint8_t *raw_base, uint8_t *buffer,
+                                arrow::util::Codec *codec, std::vector<uint8_t>& scratch) {
+    PackedTransfer t = raw;
+    t.codec = codec->compression_type();
+
+    // where the bytes of every buffer are staged, in layout order
+    std::vector<std::pair<bool, int64_t>> sources;
+    int64_t used = 0;
+    for (auto &c : t.columns) {
+        ForEachBuffer(c, [&](BufferSpan& buff) {
+            const uint8_t *src = raw_base + buff.offset;
+            if (buff.size >= kMinCompressSize) {
+                int64_t max_len = codec->MaxCompressedLen(buff.size, src);
+                if ((int64_t)scratch.size() < used + max_len) {
+                    scratch.resize(used + max_len);
+                }
+                arrow::Result<int64_t> len = codec->Compress(buff.size, src, max_len, scratch.data() + used);
+                if (len.ok() && *len < buff.size) {
+                    sources.push_back(std::make_pair(true, used));
+                    used += *len;
+                    buff.raw_size = buff.size;
+                    buff.size = *len;
+                    return;
+                }
+            }
+            sources.push_back(std::make_pair(false, (int64_t)buff.offset));
+        });
+    }
+
+    WriteLayout(t, buffer);
+    size_t k = 0;
+    for (auto &c : t.columns) {
+        ForEachBuffer(c, [&](BufferSpan& buff) {
+            const std::pair<bool, int64_t> &source = sources[k++];
+            const uint8_t *src = (source.first ? scratch.data() : raw_base) + source.second;
+            memcpy(buffer + buff.offset, src, buff.size);
+        });
+    }
+    return t;
+}
+
+// reads back the layout WriteLayout put at the head of a `size` byte transfer
+arrow::Result<PackedTransfer> DecodeLayout(std::shared_ptr<arrow::Schema> schema, const uint8_t *base, int64_t size) {
+    uint32_t layout_size;
+    if (size < (int64_t)sizeof(layout_size)) {
+        return arrow::Status::Invalid("Transfer of ", size, " bytes has no layout");
+    }
+    memcpy(&layout_size, base, sizeof(layout_size));
+    if (layout_size < 2 || (int64_t)layout_size > size - (int64_t)sizeof(layout_size)) {
+        return arrow::Status::Invalid("Transfer layout of ", layout_size, " bytes does not fit in ", size);
+    }
+    const uint8_t *pos = base + sizeof(layout_size);
+    const uint8_t *end = pos + layout_size;
+    if (*pos != kLayoutVersion) {
+        return arrow::Status::NotImplemented("Transfer layout version ", (int)*pos);
+    }
+    pos++;
+
+    PackedTransfer t;
+    t.codec = (arrow::Compression::type)*pos++;
+    bool compressed = t.codec != arrow::Compression::UNCOMPRESSED;
+    ARROW_ASSIGN_OR_RAISE(int32_t num_batches, GetVarint(&pos, end));
+    ARROW_ASSIGN_OR_RAISE(int32_t num_columns, GetVarint(&pos, end));
+    if (num_columns != schema->num_fields()) {
+        return arrow::Status::Invalid("Transfer has ", num_columns, " columns, the schema ", schema->num_fields());
+    }
+    for (int32_t i = 0; i < num_columns; i++) {
+        for (int32_t expected : TypeTags(schema->field(i)->type())) {
+            ARROW_ASSIGN_OR_RAISE(int32_t tag, GetVarint(&pos, end));
+            if (tag != expected) {
+                return arrow::Status::TypeError("Column ", schema->field(i)->ToString(),
+                                                " does not match the type the server sent");
+            }
+            t.type_tags.push_back(tag);
+        }
+    }
+
+    int64_t curr_pos = PaddedSize(sizeof(layout_size) + layout_size);
+    auto place = [&](BufferSpan *buff) -> arrow::Status {
+        ARROW_ASSIGN_OR_RAISE(buff->size, GetVarint(&pos, end));
+        if (compressed) {
+            ARROW_ASSIGN_OR_RAISE(buff->raw_size, GetVarint(&pos, end));
+        }
+        buff->offset = curr_pos;
+        curr_pos += PaddedSize(buff->size);
+        return arrow::Status::OK();
+    };
+    for (int32_t b = 0; b < num_batches; b++) {
+        ARROW_ASSIGN_OR_RAISE(int32_t num_rows, GetVarint(&pos, end));
+        t.batch_sizes.push_back(num_rows);
+        for (int32_t i = 0; i < num_columns; i++) {
+            ColumnLayout c;
+            ARROW_ASSIGN_OR_RAISE(c.null_count, GetVarint(&pos, end));
+            ARROW_RETURN_NOT_OK(place(&c.validity));
+            ARROW_RETURN_NOT_OK(place(&c.data));
+            ARROW_RETURN_NOT_OK(place(&c.offsets));
+            bool is_signed;
+            if (IntegerWidth(schema->field(i)->type(), &is_signed) > 0) {
+                c.has_encoding = true;
+                ARROW_ASSIGN_OR_RAISE(c.encoding, GetVarint(&pos, end));
+                if (c.encoding != kPlain && c.encoding != kForBitpack && c.encoding != kRle) {
+                    return arrow::Status::NotImplemented("Integer encoding ", c.encoding);
+                }
+            }
+            if (schema->field(i)->type()->id() == arrow::Type::DICTIONARY) {
+                c.has_dictionary = true;
+                ARROW_ASSIGN_OR_RAISE(c.dict_length, GetVarint(&pos, end));
+                ARROW_ASSIGN_OR_RAISE(c.dict_null_count, GetVarint(&pos, end));
+                ARROW_RETURN_NOT_OK(place(&c.dict_validity));
+                ARROW_RETURN_NOT_OK(place(&c.dict_data));
+                ARROW_RETURN_NOT_OK(place(&c.dict_offsets));
+            }
+            t.columns.push_back(c);
+        }
+    }
+    if (curr_pos > size) {
+        return arrow::Status::Invalid("Transfer layout describes ", curr_pos, " bytes, got ", size);
+    }
+    t.total_size = curr_pos;
+    return t;
+}
+
+// how the bytes of a transfer are framed: the layout header of PackBatches,
+// or a run of Arrow IPC stream messages (see ipc_transfer.h)
+enum TransferFormat : int32_t {
+    kPackedFormat = 0,
+    kIpcFormat = 1,
+};
+
+// Cuts the scan into transfers of about `target` bytes that never exceed
+// `capacity`. A batch that does not fit in what is left of a transfer is
+// sliced when splitting is allowed; the rest of it starts the next transfer.
+// Batches are measured with `size_of`, the packed layout unless told otherwise.
+class TransferSource {
+    public:
+        using SizeFn = std::function<int64_t(const std::shared_ptr<arrow::RecordBatch>&)>;
+
+        TransferSource(std::shared_ptr<arrow::RecordBatchReader> reader, SizeFn size_of = PackedBatchSize)
+            : reader_(std::move(reader)), size_of_(std::move(size_of)) {}
+
+        // an empty vector means the scan is over
+        arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> Next(int64_t target, int64_t capacity, bool allow_split = true) {
+            std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+            int64_t total_size = 0;
+            while (total_size < target) {
+                std::shared_ptr<arrow::RecordBatch> batch = std::move(pending_);
+                pending_ = nullptr;
+                if (batch == nullptr) {
+                    ARROW_RETURN_NOT_OK(reader_->ReadNext(&batch));
+                    if (batch == nullptr) {
+                        break;
+                    }
+                }
+                if (batch->num_rows() == 0) {
+                    continue;
+                }
+
+                int64_t size = size_of_(batch);
+                if (total_size + size <= capacity) {
+                    batches.push_back(batch);
+                    total_size += size;
+                    continue;
+                }
+
+                int64_t rows = 0;
+                if (allow_split) {
+                    int64_t space = capacity - total_size;
+                    rows = batch->num_rows() * space / size;
+                    while (rows > 0 && size_of_(batch->Slice(0, rows)) > space) {
+                        rows = std::min(rows - 1, rows * 7 / 8);
+                    }
+                }
+                if (rows == 0) {
+                    if (batches.empty()) {
+                        return arrow::Status::Invalid("A batch of ", size, " bytes does not fit in a ", capacity, " byte transfer");
+                    }
+                    pending_ = batch;
+                    break;
+                }
+                batches.push_back(batch->Slice(0, rows));
+                pending_ = batch->Slice(rows);
+                break;
+            }
+            return batches;
+        }
+
+    private:
+        std::shared_ptr<arrow::RecordBatchReader> reader_;
+        SizeFn size_of_;
+        std::shared_ptr<arrow::RecordBatch> pending_;
+};
+
+// Picks the transfer size from what the link actually does. A transfer takes
+// about latency + bytes / bandwidth, both fitted by least squares over the
+// last few transfers, and the target is the size at which the fixed latency
+// is ~10% of the transfer time. Every few transfers a smaller one is asked
+// for so the fit keeps seeing more than one size.
+class TransferSizer {
+    public:
+        TransferSizer(int64_t initial, int64_t min_size, int64_t max_size)
+            : target_(initial), min_size_(min_size), max_size_(max_size) {}
+
+        int64_t Target() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            if (++calls_ % kProbeInterval == 0) {
+                return std::max(min_size_, target_ / 4);
+            }
+            return target_;
+        }
+
+        void Record(int64_t bytes, double seconds) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            samples_.push_back(std::make_pair((double)bytes, seconds));
+            if (samples_.size() > kWindow) {
+                samples_.erase(samples_.begin());
+            }
+            if (samples_.size() < 4) {
+                return;
+            }
+
+            double n = samples_.size(), sx = 0, sy = 0, sxx = 0, sxy = 0;
+            for (auto &sample : samples_) {
+                sx += sample.first;
+                sy += sample.second;
+                sxx += sample.first * sample.first;
+                sxy += sample.first * sample.second;
+            }
+            double denom = n * sxx - sx * sx;
+            if (denom <= 0) {
+                return;
+            }
+            double seconds_per_byte = (n * sxy - sx * sy) / denom;
+            double latency = (sy - seconds_per_byte * sx) / n;
+            if (seconds_per_byte <= 0 || latency <= 0) {
+                return;
+            }
+            int64_t target = (int64_t)(latency / seconds_per_byte * kLatencyFactor);
+            target_ = std::max(min_size_, std::min(max_size_, target));
+            bandwidth_ = 1.0 / seconds_per_byte;
+        }
+
+        // fitted bytes per second, 0 until there are enough transfers
+        double Bandwidth() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            return bandwidth_;
+        }
+
+    private:
+        static constexpr size_t kWindow = 32;
+        static constexpr int64_t kProbeInterval = 8;
+        static constexpr double kLatencyFactor = 9.0;
+
+        tl::mutex mutex_;
+        std::vector<std::pair<double, double>> samples_;
+        int64_t calls_ = 0;
+        int64_t target_;
+        int64_t min_size_;
+        int64_t max_size_;
+        double bandwidth_ = 0;
+};
+
+// Decides per transfer whether to compress. The producer runs ahead of the
+// link, so a scan moves min(pack speed, bandwidth / ratio) raw bytes per
+// second compressed and `bandwidth` raw; compression stays on while packing
+// with it outruns the link and it actually shrinks the data. While it is off
+// every kProbeInterval-th transfer is compressed anyway to keep the pack
+// speed and ratio up to date.
+class CompressionController {
+    public:
+        CompressionController(std::unique_ptr<arrow::util::Codec> codec) : codec_(std::move(codec)) {}
+
+        // the codec for the next transfer, nullptr to send it raw
+        arrow::util::Codec* Choose(double bandwidth) {
+            bool enabled = true;
+            if (bandwidth > 0 && speed_ > 0) {
+                enabled = speed_ > bandwidth && ratio_ < 1.0;
+            }
+            if (!enabled && ++calls_ % kProbeInterval == 0) {
+                enabled = true;
+            }
+            return enabled ? codec_.get() : nullptr;
+        }
+
+        // a transfer of `raw_bytes` was packed into `wire_bytes` in `seconds`
+        void Record(int64_t raw_bytes, int64_t wire_bytes, double seconds) {
+            if (raw_bytes == 0 || seconds <= 0) {
+                return;
+            }
+            double speed = raw_bytes / seconds;
+            double ratio = (double)wire_bytes / raw_bytes;
+            if (speed_ == 0) {
+                speed_ = speed;
+                ratio_ = ratio;
+            } else {
+                speed_ += kSmoothing * (speed - speed_);
+                ratio_ += kSmoothing * (ratio - ratio_);
+            }
+        }
+
+    private:
+        static constexpr int64_t kProbeInterval = 16;
+        static constexpr double kSmoothing = 0.25;
+
+        std::unique_ptr<arrow::util::Codec> codec_;
+        double speed_ = 0;
+        double ratio_ = 1.0;
+        int64_t calls_ = 0;
+};
+
+// "none" or an arrow codec name (lz4, zstd, ...), nullptr for none
+arrow::Result<std::shared_ptr<CompressionController>> MakeCompressionController(const std::string& name) {
+    if (name == "none") {
+        return std::shared_ptr<CompressionController>();
+    }
+    ARROW_ASSIGN_OR_RAISE(arrow::Compression::type type, arrow::util::Codec::GetCompressionType(name));
+    ARROW_ASSIGN_OR_RAISE(std::unique_ptr<arrow::util::Codec> codec, arrow::util::Codec::Create(type));
+    return std::make_shared<CompressionController>(std::move(codec));
+}
+
+// A fixed ring of exposed transfer segments. A producer ULT scans and packs
+// into free slots while the client is still pulling earlier ones, so the
+// Parquet decoder, the memcpy and the RDMA of consecutive transfers overlap.
+// Slots are handed out and given back strictly in order.
+class TransferRing {
+    public:
+        struct Slot {
+            uint8_t *buffer;
+            tl::bulk bulk;
+            PackedTransfer transfer;
+            // handed out and given back, waiting for the older ones
+            bool released = false;
+        };
+
+        TransferRing() {}
+
+        // allocate and expose every slot once, the expose cost is never paid again
+        void Expose(tl::engine& engine, int32_t num_slots, int32_t slot_size) {
+            slots_.resize(num_slots);
+            for (auto &slot : slots_) {
+                slot.buffer = (uint8_t*)malloc(slot_size);
+                std::vector<std::pair<void*,std::size_t>> segments(1);
+                segments[0].first = (void*)slot.buffer;
+                segments[0].second = slot_size;
+                slot.bulk = engine.expose(segments, tl::bulk_mode::read_write);
+            }
+            slot_size_ = slot_size;
+        }
+
+        int32_t SlotSize() const { return slot_size_; }
+
+        // stop the current producer (if any) and wait for it to leave, then
+        // make the ring ready for a new scan
+        void Reset() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            AbortLocked(lock);
+            produced_ = consumed_ = released_ = 0;
+            for (auto &slot : slots_) {
+                slot.released = false;
+            }
+            aborted_ = false;
+            done_ = false;
+            status_ = arrow::Status::OK();
+        }
+
+        // producer side: blocks until the next slot is free, nullptr if the scan was reset
+        Slot* AcquireFree() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            while (produced_ - released_ >= (int64_t)slots_.size() && !aborted_) {
+                cv_.wait(lock);
+            }
+            if (aborted_) {
+                return nullptr;
+            }
+            return &slots_[produced_ % slots_.size()];
+        }
+
+        void Publish() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            produced_++;
+            cv_.notify_all();
+        }
+
+        // the producer must always call this on its way out, with the error
+        // that ended the scan early if there was one
+        void Close(arrow::Status status = arrow::Status::OK()) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            if (status_.ok()) {
+                status_ = std::move(status);
+            }
+            done_ = true;
+            cv_.notify_all();
+        }
+
+        // why the scan ended, OK when the reader was exhausted; only final
+        // once AcquireReady returned nullptr
+        arrow::Status status() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            return status_;
+        }
+
+        // consumer side: blocks until a packed slot is available, nullptr at end
+        // of stream. `seq` receives the position of the slot in the scan.
+        Slot* AcquireReady(int64_t *seq = nullptr) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            waiting_++;
+            while (consumed_ == produced_ && !done_ && !aborted_) {
+                cv_.wait(lock);
+            }
+            waiting_--;
+            if (aborted_) {
+                cv_.notify_all();
+                return nullptr;
+            }
+            if (consumed_ == produced_) {
+                return nullptr;
+            }
+            if (seq != nullptr) {
+                *seq = consumed_;
+            }
+            return &slots_[consumed_++ % slots_.size()];
+        }
+
+        // give back every slot handed to the consumer so far
+        void ReleaseConsumed() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            for (; released_ < consumed_; released_++) {
+                slots_[released_ % slots_.size()].released = false;
+            }
+            cv_.notify_all();
+        }
+
+        // give back the slot handed out as `seq`, in any order; the producer
+        // only gets slots back once every older one is released too
+        void Release(int64_t seq) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            if (seq < released_ || seq >= consumed_) {
+                return;
+            }
+            slots_[seq % slots_.size()].released = true;
+            while (released_ < consumed_ && slots_[released_ % slots_.size()].released) {
+                slots_[released_ % slots_.size()].released = false;
+                released_++;
+            }
+            cv_.notify_all();
+        }
+
+        // true once nothing handed to the consumer is still in use
+        bool AllReleased() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            return released_ == consumed_;
+        }
+
+        // give up on the scan: the producer stops, waiting consumers get
+        // nullptr, and so does everyone after them until the next Reset.
+        // A scan that had not failed by then ends Cancelled.
+        void Abort() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            AbortLocked(lock);
+        }
+
+    private:
+        void AbortLocked(std::unique_lock<tl::mutex>& lock) {
+            aborted_ = true;
+            cv_.notify_all();
+            while (!done_ || waiting_ > 0) {
+                cv_.wait(lock);
+            }
+            if (status_.ok()) {
+                status_ = arrow::Status::Cancelled("Scan was cancelled");
+            }
+        }
+
+        std::vector<Slot> slots_;
+        int32_t slot_size_ = 0;
+
+        tl::mutex mutex_;
+        tl::condition_variable cv_;
+        int64_t produced_ = 0;
+        int64_t consumed_ = 0;
+        int64_t released_ = 0;
+        // consumers blocked in AcquireReady
+        int32_t waiting_ = 0;
+        bool aborted_ = false;
+        bool done_ = true;
+        arrow::Status status_;
+};
+
+// Exposed rings shared by concurrent scans, each scan holds one for its
+// lifetime so two clients never pack into the same memory. Acquire blocks
+// while every ring is in use.
+class RingPool {
+    public:
+        RingPool(tl::engine& engine, int32_t num_rings, int32_t num_slots, int32_t slot_size) {
+            for (int32_t i = 0; i < num_rings; i++) {
+                rings_.push_back(std::make_unique<TransferRing>());
+                rings_.back()->Expose(engine, num_slots, slot_size);
+                free_rings_.push_back(rings_.back().get());
+            }
+        }
+
+        TransferRing* Acquire() {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            while (free_rings_.empty()) {
+                cv_.wait(lock);
+            }
+            TransferRing *ring = free_rings_.back();
+            free_rings_.pop_back();
+            return ring;
+        }
+
+        void Release(TransferRing *ring) {
+            std::unique_lock<tl::mutex> lock(mutex_);
+            free_rings_.push_back(ring);
+            cv_.notify_one();
+        }
+
+    private:
+        std::vector<std::unique_ptr<TransferRing>> rings_;
+        std::vector<TransferRing*> free_rings_;
+        tl::mutex mutex_;
+        tl::condition_variable cv_;
+};
+
+// producer loop of a scan: fills ring slots with transfers sized by `sizer`
+// until the reader is exhausted or the ring is reset. A column that can't go
+// on the wire or a failing reader closes the ring with the error. With a `compression`
+// controller, transfers it picks a codec for are packed raw into scratch
+// memory first and compressed into the slot from there.
+void ProduceTransfers(TransferRing& ring, std::shared_ptr<arrow::RecordBatchReader> reader, TransferSizer& sizer,
+                      std::shared_ptr<CompressionController> compression = nullptr) {
+    for (auto &field : reader->schema()->fields()) {
+        if (!IsWireType(field->type())) {
+            ring.Close(arrow::Status::NotImplemented("Can't transfer column ", field->ToString()));
+            return;
+        }
+    }
+
+    TransferSource source(reader);
+    PackState state;
+    while (true) {
+        TransferRing::Slot *slot = ring.AcquireFree();
+        if (slot == nullptr) {
+            break;
+        }
+        arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> batches =
+            source.Next(sizer.Target(), ring.SlotSize() - kLayoutPrefixBound - LayoutTypesBound(reader->schema()->num_fields()));
+        if (!batches.ok()) {
+            ring.Close(batches.status());
+            return;
+        }
+        if (batches->size() == 0) {
+            break;
+        }
+
+        arrow::util::Codec *codec = compression ? compression->Choose(sizer.Bandwidth()) : nullptr;
+        if (codec == nullptr) {
+            slot->transfer = PackBatches(*batches, slot->buffer, state);
+        } else {
+            auto pack_start = std::chrono::steady_clock::now();
+            state.raw.resize(ring.SlotSize());
+            PackedTransfer raw = PackBatches(*batches, state.raw.data(), state);
+            slot->transfer = CompressTransfer(raw, state.raw.data(), slot->buffer, codec, state.compressed);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - pack_start;
+            compression->Record(raw.total_size, slot->transfer.total_size, elapsed.count());
+        }
+        ring.Publish();
+    }
+    ring.Close();
+}
+
+// what the client of a scan carries from one transfer to the next
+struct UnpackState {
+    // the dictionary of every column as last received
+    std::vector<std::shared_ptr<arrow::ArrayData>> dictionaries;
+    // created on the first compressed transfer
+    std::unique_ptr<arrow::util::Codec> codec;
+    // decompressed buffers are allocated from here
+    arrow::MemoryPool *pool = arrow::default_memory_pool();
+};
+
+// a copy of `buff` in memory of its own
+arrow::Result<std::shared_ptr<arrow::Buffer>> CopyBuffer(const std::shared_ptr<arrow::Buffer>& buff) {
+    ARROW_ASSIGN_OR_RAISE(std::unique_ptr<arrow::Buffer> copy, arrow::AllocateBuffer(buff->size()));
+    memcpy(copy->mutable_data(), buff->data(), buff->size());
+    return std::shared_ptr<arrow::Buffer>(std::move(copy));
+}
+
+// the ArrayData of a non dictionary column, binary ones keep offsets before data
+std::shared_ptr<arrow::ArrayData> MakeColumnData(std::shared_ptr<arrow::DataType> type, int64_t length,
+                                                 std::shared_ptr<arrow::Buffer> validity, int64_t null_count,
+                                                 std::shared_ptr<arrow::Buffer> data, std::shared_ptr<arrow::Buffer> offsets) {
+    if (is_binary_like(type->id()) || is_large_binary_like(type->id())) {
+        return arrow::ArrayData::Make(std::move(type), length, {std::move(validity), std::move(offsets), std::move(data)}, null_count);
+    }
+    return arrow::ArrayData::Make(std::move(type), length, {std::move(validity), std::move(data)}, null_count);
+}
+
+// the contents of `buff`, decompressed into memory of the state's pool when
+// it was sent compressed
+template <typename MakeBuffer>
+arrow::Result<std::shared_ptr<arrow::Buffer>> LoadBuffer(const PackedTransfer& t, const BufferSpan& buff,
+                                                         UnpackState& state, MakeBuffer& make_buffer) {
+    std::shared_ptr<arrow::Buffer> wire = make_buffer(buff.offset, buff.size);
+    if (buff.raw_size == 0) {
+        return wire;
+    }
+    if (state.codec == nullptr || state.codec->compression_type() != t.codec) {
+        ARROW_ASSIGN_OR_RAISE(state.codec, arrow::util::Codec::Create(t.codec));
+    }
+    ARROW_ASSIGN_OR_RAISE(std::unique_ptr<arrow::Buffer> raw, arrow::AllocateBuffer(buff.raw_size, state.pool));
+    ARROW_ASSIGN_OR_RAISE(int64_t len, state.codec->Decompress(wire->size(), wire->data(), buff.raw_size, raw->mutable_data()));
+    if (len != buff.raw_size) {
+        return arrow::Status::IOError("Buffer decompressed to ", len, " bytes instead of ", buff.raw_size);
+    }
+    return std::shared_ptr<arrow::Buffer>(std::move(raw));
+}
+
+// plain values of an encoded integer column, in memory of the state's pool
+arrow::Result<std::shared_ptr<arrow::Buffer>> DecodeColumn(const std::shared_ptr<arrow::DataType>& type, const ColumnLayout& c, int64_t num_rows,
+                                                           const std::shared_ptr<arrow::Buffer>& encoded, UnpackState& state) {
+    bool is_signed;
+    int32_t width = IntegerWidth(type, &is_signed);
+    ARROW_ASSIGN_OR_RAISE(std::unique_ptr<arrow::Buffer> plain, arrow::AllocateBuffer(num_rows * width, state.pool));
+    ARROW_RETURN_NOT_OK(DispatchInteger(width, is_signed, [&](auto *tag) {
+        return DecodeIntegers(encoded->data(), encoded->size(), (IntegerEncoding)c.encoding, num_rows, (decltype(tag))plain->mutable_data());
+    }));
+    return std::shared_ptr<arrow::Buffer>(std::move(plain));
+}
+
+// rebuilds the batches of a transfer in the layout of PackBatches,
+// `make_buffer(offset, size)` returns the buffer holding the bytes the server
+// wrote at `offset` of the transfer. Transfers of a scan must be unpacked in
+// the order they were packed since dictionaries are only sent on change.
+template <typename MakeBuffer>
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> UnpackTransfer(std::shared_ptr<arrow::Schema> schema, const PackedTransfer& t,
+                                                                               UnpackState& state, MakeBuffer make_buffer) {
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+    int num_cols = schema->num_fields();
+    state.dictionaries.resize(num_cols);
+    for (int32_t batch_idx = 0; batch_idx < t.batch_sizes.size(); batch_idx++) {
+        int32_t num_rows = t.batch_sizes[batch_idx];
+        std::vector<std::shared_ptr<arrow::Array>> columns;
+
+        for (int32_t i = 0; i < num_cols; i++) {
+            const ColumnLayout &c = t.columns[batch_idx * num_cols + i];
+            std::shared_ptr<arrow::DataType> type = schema->field(i)->type();
+            std::shared_ptr<arrow::Buffer> validity;
+            if (c.null_count > 0) {
+                ARROW_ASSIGN_OR_RAISE(validity, LoadBuffer(t, c.validity, state, make_buffer));
+            }
+            ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> data, LoadBuffer(t, c.data, state, make_buffer));
+
+            if (type->id() == arrow::Type::DICTIONARY) {
+                std::shared_ptr<arrow::DataType> value_type = static_cast<const arrow::DictionaryType&>(*type).value_type();
+                if (c.dict_length > 0) {
+                    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> dict_data, LoadBuffer(t, c.dict_data, state, make_buffer));
+                    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> dict_offsets, LoadBuffer(t, c.dict_offsets, state, make_buffer));
+                    // dictionaries outlive the transfer they came in
+                    std::shared_ptr<arrow::Buffer> dict_validity;
+                    if (c.dict_null_count > 0) {
+                        ARROW_ASSIGN_OR_RAISE(dict_validity, LoadBuffer(t, c.dict_validity, state, make_buffer));
+                        if (c.dict_validity.raw_size == 0) {
+                            ARROW_ASSIGN_OR_RAISE(dict_validity, CopyBuffer(dict_validity));
+                        }
+                    }
+                    if (c.dict_data.raw_size == 0) {
+                        ARROW_ASSIGN_OR_RAISE(dict_data, CopyBuffer(dict_data));
+                    }
+                    if (c.dict_offsets.raw_size == 0) {
+                        ARROW_ASSIGN_OR_RAISE(dict_offsets, CopyBuffer(dict_offsets));
+                    }
+                    state.dictionaries[i] = MakeColumnData(value_type, c.dict_length, dict_validity, c.dict_null_count, dict_data, dict_offsets);
+                } else if (state.dictionaries[i] == nullptr) {
+                    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Array> empty, arrow::MakeEmptyArray(value_type));
+                    state.dictionaries[i] = empty->data();
+                }
+                std::shared_ptr<arrow::ArrayData> indices = arrow::ArrayData::Make(type, num_rows, {validity, data}, c.null_count);
+                indices->dictionary = state.dictionaries[i];
+                columns.push_back(arrow::MakeArray(indices));
+            } else {
+                if (c.encoding != kPlain) {
+                    ARROW_ASSIGN_OR_RAISE(data, DecodeColumn(type, c, num_rows, data, state));
+                }
+                ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> offsets, LoadBuffer(t, c.offsets, state, make_buffer));
+                columns.push_back(arrow::MakeArray(MakeColumnData(type, num_rows, validity, c.null_count, data, offsets)));
+            }
+        }
+        batches.push_back(arrow::RecordBatch::Make(schema, num_rows, columns));
+    }
+    return batches;
+}
+
+// rebuilds the batches of a transfer described by the five vectors of
+// ScanRespStub and friends, values only. `make_buffer(offset, size)` returns
+// the buffer holding the bytes the server wrote at `offset` of the transfer
+template <typename Layout, typename MakeBuffer>
+std::vector<std::shared_ptr<arrow::RecordBatch>> UnpackBatchesWith(std::shared_ptr<arrow::Schema> schema, const Layout& resp, MakeBuffer make_buffer) {
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+    int num_cols = schema->num_fields();
+    for (int32_t batch_idx = 0; batch_idx < resp.batch_sizes.size(); batch_idx++) {
+        int32_t num_rows = resp.batch_sizes[batch_idx];
+        std::vector<std::shared_ptr<arrow::Array>> columns;
+
+        for (int64_t i = 0; i < num_cols; i++) {
+            int32_t magic_off = (batch_idx * num_cols) + i;
+            std::shared_ptr<arrow::DataType> type = schema->field(i)->type();
+            std::shared_ptr<arrow::Buffer> data_buff = make_buffer(resp.data_offsets[magic_off], resp.data_sizes[magic_off]);
+            if (is_binary_like(type->id())) {
+                std::shared_ptr<arrow::Buffer> offset_buff = make_buffer(resp.off_offsets[magic_off], resp.off_sizes[magic_off]);
+                columns.push_back(std::make_shared<arrow::StringArray>(num_rows, std::move(offset_buff), std::move(data_buff)));
+            } else {
+                columns.push_back(std::make_shared<arrow::PrimitiveArray>(type, num_rows, std::move(data_buff)));
+            }
+        }
+        batches.push_back(arrow::RecordBatch::Make(schema, num_rows, columns));
+    }
+    return batches;
+}
+
+// the arrays alias `base` so they are only valid until the region is reused
+template <typename Layout>
+std::vector<std::shared_ptr<arrow::RecordBatch>> UnpackBatches(std::shared_ptr<arrow::Schema> schema, uint8_t *base, const Layout& resp) {
+    return UnpackBatchesWith(schema, resp, [base](int32_t offset, int32_t size) {
+        return arrow::Buffer::Wrap(base + offset, size);
+    });
+}